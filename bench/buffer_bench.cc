@@ -0,0 +1,111 @@
+// buffer allocation throughput, the slab buffers against a shared_ptr
+// buffer with a malloc'ed payload like the one they replace
+// make bench && ./buffer_bench [buffers]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mem_alloc.h"
+#include "utils.h"
+
+using namespace rockin;
+
+#define BENCH_ROUNDS 5
+
+namespace {
+std::atomic<uint64_t> g_heap_size;
+
+struct HeapBuffer {
+  char *data;
+  size_t len;
+
+  HeapBuffer(const char *d, size_t l) : len(l) {
+    data = (char *)malloc(l);
+    memcpy(data, d, l);
+  }
+  ~HeapBuffer() { free(data); }
+};
+
+typedef std::shared_ptr<HeapBuffer> HeapPtr;
+
+HeapPtr MakeHeap(const char *d, size_t l) {
+  HeapPtr ptr(new HeapBuffer(d, l), [](HeapBuffer *ptr) {
+    g_heap_size.fetch_sub(sizeof(HeapBuffer) + ptr->len);
+    delete ptr;
+  });
+  g_heap_size.fetch_add(sizeof(HeapBuffer) + l);
+  return ptr;
+}
+}  // namespace
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  return d.count();
+}
+
+// make a reply sized buffer per number and drop it, as ReplyInteger does
+template <typename P, typename F>
+static double Churn(int n, F make) {
+  double best = 0;
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    auto start = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+      char num[32];
+      int len = Int64ToString(num, sizeof(num), i);
+      P buf = make(num, len);
+      bytes += buf->len;
+    }
+    double mops = n / Seconds(start) / 1e6;
+    if (bytes > 0 && mops > best) best = mops;
+  }
+  return best;
+}
+
+// a worker makes the buffers of a batch of replies and the loop thread
+// frees them once they are written
+template <typename P, typename F>
+static double Handoff(int n, size_t value_size, F make) {
+  std::string value(value_size, 'v');
+  double best = 0;
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<P> batch;
+    std::thread loop;
+    for (int i = 0; i < n; i++) {
+      batch.push_back(make(value.data(), value.length()));
+      if (batch.size() == 1024 || i == n - 1) {
+        if (loop.joinable()) loop.join();
+        loop = std::thread([b = std::move(batch)]() mutable { b.clear(); });
+        batch.clear();
+      }
+    }
+    if (loop.joinable()) loop.join();
+    double mops = n / Seconds(start) / 1e6;
+    if (mops > best) best = mops;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 10000000;
+  auto heap = [](const char *d, size_t l) { return MakeHeap(d, l); };
+  auto slab = [](const char *d, size_t l) { return make_buffer(d, l); };
+
+  printf("%d buffers, million buffers per second\n", n);
+  printf("%-24s %10s %10s\n", "", "heap", "slab");
+  printf("%-24s %10.2f %10.2f\n", "integer replies", Churn<HeapPtr>(n, heap),
+         Churn<BufPtr>(n, slab));
+  for (size_t size : {16, 256, 2048}) {
+    std::string name = "handoff " + std::to_string(size) + " bytes";
+    printf("%-24s %10.2f %10.2f\n", name.c_str(),
+           Handoff<HeapPtr>(n / 4, size, heap),
+           Handoff<BufPtr>(n / 4, size, slab));
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+// hit rate of the object cache of a worker, W-TinyLFU against plain lru,
+// on a Zipf trace of hot keys mixed with a scan of keys read once
+// make bench && ./cache_bench [requests] [cache objects]
+#include <gflags/gflags.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mem_alloc.h"
+#include "mem_saver.h"
+#include "utils.h"
+
+DECLARE_int64(cache_max_memory);
+DECLARE_int32(cache_window_percent);
+
+using namespace rockin;
+
+#define BENCH_KEYS 100000
+#define BENCH_ZIPF_S 0.9
+#define BENCH_VALUE_SIZE 100
+
+// one request in BENCH_SCAN_EVERY reads a key never seen before
+#define BENCH_SCAN_EVERY 3
+
+// the key of each request, scan keys are negative
+static std::vector<int64_t> BuildTrace(int n) {
+  std::vector<double> cdf(BENCH_KEYS);
+  double sum = 0;
+  for (int i = 0; i < BENCH_KEYS; i++) {
+    sum += 1.0 / pow(i + 1, BENCH_ZIPF_S);
+    cdf[i] = sum;
+  }
+
+  std::mt19937_64 rng(1);
+  std::uniform_real_distribution<double> uniform(0, sum);
+  std::vector<int64_t> trace;
+  int64_t scan = 0;
+  for (int i = 0; i < n; i++) {
+    if (i % BENCH_SCAN_EVERY == BENCH_SCAN_EVERY - 1) {
+      trace.push_back(-(++scan));
+    } else {
+      trace.push_back(std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) -
+                      cdf.begin());
+    }
+  }
+  return trace;
+}
+
+static BufPtr MakeKey(int64_t id) {
+  return make_buffer(id < 0 ? Format("scan:%lld", (long long)-id)
+                            : Format("key:%lld", (long long)id));
+}
+
+// the memory of one cached object, read from the cache of a thread of its
+// own
+static int64_t ObjectCharge(int idx) {
+  int64_t charge = 0;
+  std::thread probe([idx, &charge]() {
+    MemSaver::Default()->Init(idx, 1);
+    BufPtr value = make_buffer(std::string(BENCH_VALUE_SIZE, 'v'));
+    MemSaver::Default()->InsertObj(make_object(MakeKey(0), value));
+
+    std::string info = MemSaver::Default()->Info();
+    const char *used = strstr(info.c_str(), "cache_used_memory:");
+    charge = atoll(used + strlen("cache_used_memory:"));
+    MemSaver::Default()->Clear();
+  });
+  probe.join();
+  return charge;
+}
+
+// a worker reads every key of the trace and caches the misses, as
+// GetStringObj does
+static double HitRate(int idx, int window_percent,
+                      const std::vector<int64_t> &trace) {
+  FLAGS_cache_window_percent = window_percent;
+  double rate = 0;
+  std::thread worker([idx, &trace, &rate]() {
+    MemSaver::Default()->Init(idx, 1);
+    BufPtr value = make_buffer(std::string(BENCH_VALUE_SIZE, 'v'));
+    size_t hits = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+      BufPtr key = MakeKey(trace[i]);
+      if (MemSaver::Default()->GetObj(key) != nullptr) {
+        hits++;
+      } else {
+        MemSaver::Default()->InsertObj(make_object(key, value));
+      }
+    }
+    rate = (double)hits / trace.size();
+    MemSaver::Default()->Clear();
+  });
+  worker.join();
+  return rate;
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 3000000;
+  int objects = argc > 2 ? atoi(argv[2]) : 1000;
+
+  int64_t charge = ObjectCharge(0);
+  FLAGS_cache_max_memory = charge * objects;
+  std::vector<int64_t> trace = BuildTrace(n);
+
+  printf("%d requests, Zipf(%.1f) over %d keys, 1 in %d a scan key\n", n,
+         BENCH_ZIPF_S, BENCH_KEYS, BENCH_SCAN_EVERY);
+  printf("cache of %d objects, %lld bytes each\n", objects,
+         (long long)charge);
+  printf("%-24s %10s\n", "", "hit rate");
+  printf("%-24s %9.1f%%\n", "w-tinylfu, window 1%",
+         HitRate(1, 1, trace) * 100);
+  printf("%-24s %9.1f%%\n", "lru, window 100%", HitRate(2, 100, trace) * 100);
+  return 0;
+}
@@ -0,0 +1,166 @@
+// parse throughput on pipelined GET/SET traffic
+// make bench && ./parse_bench [commands]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include "byte_buf.h"
+#include "cmd_args.h"
+#include "utils.h"
+
+using namespace rockin;
+
+#define BENCH_ROUNDS 5
+#define BENCH_CHUNK_SIZE 16384
+
+static std::string BuildPipeline(int cmds) {
+  std::string input;
+  for (int i = 0; i < cmds; i++) {
+    std::string key = "key:" + std::to_string(i);
+    if (i % 2 == 0) {
+      input += "*2\r\n$3\r\nGET\r\n$" + std::to_string(key.length()) + "\r\n" +
+               key + "\r\n";
+    } else {
+      std::string value = "value:" + std::to_string(i * 7919);
+      input += "*3\r\n$3\r\nSET\r\n$" + std::to_string(key.length()) +
+               "\r\n" + key + "\r\n$" + std::to_string(value.length()) +
+               "\r\n" + value + "\r\n";
+    }
+  }
+  return input;
+}
+
+// inline commands with long arguments, where the vectorized scan pays off
+static std::string BuildLongLines(size_t line_size, int lines) {
+  std::string input;
+  for (int i = 0; i < lines; i++) {
+    input += "SET key:" + std::to_string(i) + " ";
+    input.append(line_size, 'v');
+    input += "\r\n";
+  }
+  return input;
+}
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  return d.count();
+}
+
+static char *ByteLoopStrchr2(char *s, size_t l, char c1, char c2) {
+  for (size_t i = 1; i < l; ++i) {
+    if (s[i - 1] == c1 && s[i] == c2) return s + (i - 1);
+  }
+  return nullptr;
+}
+
+// find every line end of the input, as the header parsing does
+template <typename F>
+static double ScanLines(std::string &input, F find, size_t &lines) {
+  double best = 0;
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    auto start = std::chrono::steady_clock::now();
+    char *ptr = &input[0], *end = ptr + input.length();
+    lines = 0;
+    while (ptr < end) {
+      char *crlf = find(ptr, end - ptr, '\r', '\n');
+      if (crlf == nullptr) break;
+      ptr = crlf + 2;
+      lines++;
+    }
+    double gbs = input.length() / Seconds(start) / 1e9;
+    if (gbs > best) best = gbs;
+  }
+  return best;
+}
+
+// the same scan with the line index of a ByteBuf holding the whole input,
+// as FindLine does on a connection buffer
+static double ScanBufLines(const std::string &input, size_t &lines) {
+  double best = 0;
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    ByteBuf buf(input.length());
+    buf.append(input.data(), input.length());
+    auto start = std::chrono::steady_clock::now();
+    lines = 0;
+    while (buf.readable() > 0) {
+      char *crlf = buf.find_crlf(0);
+      if (crlf == nullptr) break;
+      buf.move_readptr(crlf - buf.readptr() + 2);
+      lines++;
+    }
+    double gbs = input.length() / Seconds(start) / 1e9;
+    if (gbs > best) best = gbs;
+  }
+  return best;
+}
+
+// feed the input as socket reads and parse every command, like a
+// connection with a pooled input buffer
+static double ParseCommands(const std::string &input, size_t &cmds) {
+  double best = 0;
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    auto start = std::chrono::steady_clock::now();
+    ChunkPool pool(BENCH_CHUNK_SIZE, 16);
+    ByteBuf buf(&pool);
+    std::shared_ptr<CmdArgs> cmd_args;
+    size_t offset = 0;
+    cmds = 0;
+    while (offset < input.length()) {
+      if (buf.writeable() == 0) buf.expand();
+      size_t n = input.length() - offset;
+      if (n > buf.writeable()) n = buf.writeable();
+      memcpy(buf.writeptr(), input.data() + offset, n);
+      buf.move_writeptr(n);
+      offset += n;
+
+      while (true) {
+        if (cmd_args == nullptr) cmd_args = std::make_shared<CmdArgs>();
+        if (cmd_args->Parse(buf) != nullptr) {
+          fprintf(stderr, "parse error at offset %zu\n", offset);
+          exit(1);
+        }
+        if (!cmd_args->is_ok()) {
+          buf.shrink();
+          break;
+        }
+        cmd_args.reset();
+        cmds++;
+      }
+    }
+    double gbs = input.length() / Seconds(start) / 1e9;
+    if (gbs > best) best = gbs;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  int cmds = argc > 1 ? atoi(argv[1]) : 1000000;
+  std::string input = BuildPipeline(cmds);
+  printf("input: %d commands, %.1f MB, strchr impl: %s\n", cmds,
+         input.length() / 1048576.0, StrchrImpl());
+
+  size_t lines = 0;
+  double gbs = ScanLines(input, ByteLoopStrchr2, lines);
+  printf("line scan  byte loop: %8.3f GB/s (%zu lines)\n", gbs, lines);
+  gbs = ScanLines(input, Strchr2, lines);
+  printf("line scan  %-9s: %8.3f GB/s (%zu lines)\n", StrchrImpl(), gbs,
+         lines);
+  gbs = ScanBufLines(input, lines);
+  printf("line scan  index    : %8.3f GB/s (%zu lines)\n", gbs, lines);
+
+  std::string long_input = BuildLongLines(65536, 512);
+  gbs = ScanLines(long_input, ByteLoopStrchr2, lines);
+  printf("long lines byte loop: %8.3f GB/s (%zu lines)\n", gbs, lines);
+  gbs = ScanLines(long_input, Strchr2, lines);
+  printf("long lines %-9s: %8.3f GB/s (%zu lines)\n", StrchrImpl(), gbs,
+         lines);
+  gbs = ScanBufLines(long_input, lines);
+  printf("long lines index    : %8.3f GB/s (%zu lines)\n", gbs, lines);
+
+  size_t parsed = 0;
+  gbs = ParseCommands(input, parsed);
+  printf("parse      CmdArgs  : %8.3f GB/s (%zu commands)\n", gbs, parsed);
+  return 0;
+}
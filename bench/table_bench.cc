@@ -0,0 +1,141 @@
+// DicTable against SwissTable as the index of the object cache
+// make bench && ./table_bench [keys]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "dic_table.h"
+#include "siphash.h"
+#include "swiss_table.h"
+
+using namespace rockin;
+
+#define BENCH_ROUNDS 3
+
+struct Item {
+  std::string key;
+  uint64_t hash;
+};
+
+struct ItemHash {
+  uint64_t operator()(const Item *item) const { return item->hash; }
+};
+
+struct ItemEqual {
+  bool operator()(const Item *a, const Item *b) const {
+    return a->key == b->key;
+  }
+};
+
+typedef SwissTable<Item *, ItemHash, ItemEqual> ItemSwissTable;
+typedef DicTable<Item> ItemDicTable;
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+  return d.count();
+}
+
+static std::vector<Item *> BuildItems(const std::string &prefix, int n) {
+  std::vector<Item *> items;
+  for (int i = 0; i < n; i++) {
+    Item *item = new Item();
+    item->key = prefix + std::to_string(i);
+    item->hash = Hash(item->key.data(), item->key.length());
+    items.push_back(item);
+  }
+  return items;
+}
+
+// million operations per second of f over every item
+template <typename F>
+static double Mops(const std::vector<Item *> &items, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < items.size(); i++) f(items[i]);
+  return items.size() / Seconds(start) / 1e6;
+}
+
+struct Result {
+  double insert, hit, miss, erase;
+};
+
+static void Best(Result &best, const Result &r) {
+  best.insert = std::max(best.insert, r.insert);
+  best.hit = std::max(best.hit, r.hit);
+  best.miss = std::max(best.miss, r.miss);
+  best.erase = std::max(best.erase, r.erase);
+}
+
+static Result RunDic(const std::vector<Item *> &keys,
+                     const std::vector<Item *> &lookups,
+                     const std::vector<Item *> &misses) {
+  ItemDicTable table(
+      [](std::shared_ptr<Item> a, std::shared_ptr<Item> b) {
+        return a->key == b->key;
+      },
+      [](std::shared_ptr<Item> item) { return item->hash; });
+
+  // the table holds shared pointers, the items outlive it
+  auto ptr = [](Item *item) {
+    return std::shared_ptr<Item>(std::shared_ptr<Item>(), item);
+  };
+
+  Result r;
+  size_t found = 0;
+  r.insert = Mops(keys, [&](Item *item) {
+    auto node = new ItemDicTable::Node();
+    node->data = ptr(item);
+    node->next = nullptr;
+    table.Insert(node);
+  });
+  auto find = [&](Item *item) { found += table.Get(ptr(item)) != 0; };
+  r.hit = Mops(lookups, find);
+  r.miss = Mops(misses, find);
+  r.erase = Mops(keys, [&](Item *item) { table.Delete(ptr(item)); });
+  if (found != lookups.size()) fprintf(stderr, "DicTable lookup mismatch\n");
+  return r;
+}
+
+static Result RunSwiss(const std::vector<Item *> &keys,
+                       const std::vector<Item *> &lookups,
+                       const std::vector<Item *> &misses) {
+  ItemSwissTable table;
+
+  Result r;
+  size_t found = 0;
+  r.insert = Mops(keys, [&](Item *item) { table.Insert(item); });
+  r.hit = Mops(lookups, [&](Item *item) { found += table.Find(item) != 0; });
+  r.miss = Mops(misses, [&](Item *item) { found += table.Find(item) != 0; });
+  r.erase = Mops(keys, [&](Item *item) { table.Erase(item); });
+  if (found != lookups.size()) fprintf(stderr, "SwissTable lookup mismatch\n");
+  return r;
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? atoi(argv[1]) : 1000000;
+  auto keys = BuildItems("key:", n);
+  auto misses = BuildItems("miss:", n);
+
+  // look the keys up in random order, as cache traffic does
+  std::vector<Item *> lookups(keys);
+  std::shuffle(lookups.begin(), lookups.end(), std::mt19937(1));
+
+  Result dic = {0, 0, 0, 0}, swiss = {0, 0, 0, 0};
+  for (int i = 0; i < BENCH_ROUNDS; i++) {
+    Best(dic, RunDic(keys, lookups, misses));
+    Best(swiss, RunSwiss(keys, lookups, misses));
+  }
+
+  printf("%d keys, million ops per second\n", n);
+  printf("%-10s %10s %10s %10s %10s\n", "table", "insert", "find hit",
+         "find miss", "erase");
+  printf("%-10s %10.2f %10.2f %10.2f %10.2f\n", "DicTable", dic.insert,
+         dic.hit, dic.miss, dic.erase);
+  printf("%-10s %10.2f %10.2f %10.2f %10.2f\n", "SwissTable", swiss.insert,
+         swiss.hit, swiss.miss, swiss.erase);
+  return 0;
+}
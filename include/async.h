@@ -1,8 +1,10 @@
 #pragma once
 #include <glog/logging.h>
 #include <uv.h>
+#include <atomic>
 #include <vector>
 #include "queue.h"
+#include "safe_queue.h"
 #include "utils.h"
 
 namespace rockin {
@@ -13,25 +15,46 @@ class AsyncQueue {
    * max_size queue max size
    */
   AsyncQueue(size_t max_size);
+  ~AsyncQueue();
 
   /*
-   * pop element form queue
-   * if queue empry, wait...
+   * pop element form queue, call in the consumer thread only
+   * if queue empty, spin for a while and then park, for timeout_ms at most
+   * when it is not 0, return nullptr if nothing came in time
    */
-  QUEUE *Pop();
+  QUEUE *Pop(uint64_t timeout_ms = 0);
 
   /*
-   * push element to queue
-   *if queue full, wait...
+   * pop element form queue without waiting
+   * return nullptr if queue empty
+   */
+  QUEUE *TryPop() { return queue_.Pop(); }
+
+  /*
+   * push element to queue without waiting
+   * return false if queue full
+   */
+  bool TryPush(QUEUE *q);
+
+  /*
+   * push element to queue, yield while queue full until the consumer
+   * makes room
    */
   void Push(QUEUE *q);
 
  private:
-  QUEUE queue_;
+  // timeout_ns 0 waits for Unpark
+  void Park(uint64_t timeout_ns);
+  void Unpark();
+
+ private:
+  SafeQueue<QUEUE> queue_;
+  std::atomic<int> parked_;
+  int spin_limit_;
+#ifndef __linux__
   uv_mutex_t mutex_;
-  uv_cond_t read_cond_, write_cond_;
-  size_t max_size_, cur_size_;
-  int read_wait_, write_wait_;
+  uv_cond_t cond_;
+#endif
 };
 
 class Async {
@@ -43,12 +66,16 @@ class Async {
   void WaitStop();
 
  protected:
+  // UV_EBUSY when the worker's queue is full, the req is not queued. with
+  // wait the caller waits for room instead, the worker drains its queue
+  // without the loop
   int AsyncQueueWork(int idx, uv_loop_t *loop, uv_work_t *req,
-                     uv_work_cb work_cb, uv_after_work_cb after_work_cb);
+                     uv_work_cb work_cb, uv_after_work_cb after_work_cb,
+                     bool wait = false);
 
  private:
   virtual void AsyncWork(int idx) = 0;
-  virtual void PostWork(int idx, QUEUE *q) = 0;
+  virtual bool PostWork(int idx, QUEUE *q, bool wait) = 0;
 
  private:
   uv_sem_t start_sem_;
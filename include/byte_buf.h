@@ -2,47 +2,287 @@
 #define _BYTEBUF_H_
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include <memory>
+#include <vector>
+#include "mem_alloc.h"
+#include "utils.h"
 
 namespace rockin {
-class ByteBuf {
+
+// refcounted block of bytes, parsed arguments slice into it
+struct ByteChunk {
+  char *data;
+  size_t cap;
+  MemCategory category;
+
+  ByteChunk(size_t c, MemCategory cat) : cap(c), category(cat) {
+    data = (char *)malloc(c);
+    change_momory_size(category, c);
+  }
+
+  ~ByteChunk() {
+    change_momory_size(category, -(int64_t)cap);
+    free(data);
+  }
+
+  // account the chunk to another category, a pooled chunk serves both
+  // reads and writes
+  void set_category(MemCategory cat) {
+    if (cat == category) return;
+    change_momory_size(category, -(int64_t)cap);
+    change_momory_size(cat, cap);
+    category = cat;
+  }
+};
+
+typedef std::shared_ptr<ByteChunk> ChunkPtr;
+
+// free chunks of one size shared by the connections of an event loop, a
+// chunk comes back from any thread since its last holder may be a worker
+class ChunkPool {
  public:
-  ByteBuf(size_t cap) : cap_(cap), read_(0), write_(0) {
-    data_ = (char *)malloc(cap);
+  ChunkPool(size_t chunk_size, size_t max_free)
+      : chunk_size_(chunk_size), max_free_(max_free) {
+    uv_mutex_init(&mutex_);
+  }
+
+  ~ChunkPool() {
+    for (size_t i = 0; i < free_.size(); i++) delete free_[i];
+    uv_mutex_destroy(&mutex_);
   }
-  ~ByteBuf() { free(data_); }
+
+  size_t chunk_size() { return chunk_size_; }
+
+  ChunkPtr Get(MemCategory category) {
+    ByteChunk *chunk = nullptr;
+    uv_mutex_lock(&mutex_);
+    if (!free_.empty()) {
+      chunk = free_.back();
+      free_.pop_back();
+    }
+    uv_mutex_unlock(&mutex_);
+
+    if (chunk == nullptr) {
+      chunk = new ByteChunk(chunk_size_, category);
+    } else {
+      chunk->set_category(category);
+    }
+    return ChunkPtr(chunk, [this](ByteChunk *chunk) { this->Put(chunk); });
+  }
+
+ private:
+  void Put(ByteChunk *chunk) {
+    chunk->set_category(Mem_Other);
+    uv_mutex_lock(&mutex_);
+    if (free_.size() < max_free_) {
+      free_.push_back(chunk);
+      chunk = nullptr;
+    }
+    uv_mutex_unlock(&mutex_);
+
+    if (chunk != nullptr) delete chunk;
+  }
+
+ private:
+  size_t chunk_size_, max_free_;
+  uv_mutex_t mutex_;
+  std::vector<ByteChunk *> free_;
+};
+
+// the chunk is taken on the first write and given back by shrink(), so an
+// idle buffer holds no memory
+class ByteBuf {
+ public:
+  ByteBuf(size_t cap, MemCategory category = Mem_Other)
+      : pool_(nullptr),
+        category_(category),
+        base_(cap),
+        read_(0),
+        write_(0),
+        line_pos_(0),
+        line_len_(0),
+        line_mask_(0) {}
+
+  ByteBuf(ChunkPool *pool, MemCategory category = Mem_Other)
+      : pool_(pool),
+        category_(category),
+        base_(pool->chunk_size()),
+        read_(0),
+        write_(0),
+        line_pos_(0),
+        line_len_(0),
+        line_mask_(0) {}
 
   size_t readable() { return write_ - read_; }
 
-  char *readptr() { return data_ + read_; }
+  char *readptr() { return chunk_ ? chunk_->data + read_ : nullptr; }
 
   void move_readptr(size_t size) {
     read_ += size;
     if (read_ > write_) read_ = write_;
+    if (read_ == write_ && chunk_.use_count() == 1) clear();
   }
 
-  size_t writeable() { return cap_ - write_; }
+  size_t writeable() { return chunk_ ? chunk_->cap - write_ : 0; }
 
-  char *writeptr() { return data_ + write_; }
+  char *writeptr() { return chunk_ ? chunk_->data + write_ : nullptr; }
 
   void move_writeptr(size_t size) {
+    size_t cap = chunk_ ? chunk_->cap : 0;
     write_ += size;
-    if (write_ > cap_) write_ = cap_;
+    if (write_ > cap) write_ = cap;
+  }
+
+  // the chunk holding readptr(), its bytes before writeptr() never move
+  // while the chunk is shared
+  const ChunkPtr &chunk() { return chunk_; }
+
+  // make room for at least size more bytes after writeptr()
+  void expand(size_t size = 1) {
+    if (chunk_ != nullptr && chunk_.use_count() == 1 && read_ > 0 &&
+        read_ >= readable() && (chunk_->cap == base_ || readable() >= base_) &&
+        chunk_->cap - readable() >= size) {
+      // at least half of the chunk is consumed, compact it
+      compact();
+      return;
+    }
+
+    // a chunk referenced by parsed arguments is left to its holders, and a
+    // chunk grown by a burst goes back to the base size
+    size_t cap = base_;
+    while (cap < readable() + size) cap = grow(cap);
+    move_chunk(cap);
+  }
+
+  // make room for size bytes from readptr(), so a large bulk is read
+  // straight into its final place
+  void reserve(size_t size) {
+    if (chunk_ != nullptr) {
+      if (chunk_->cap - read_ >= size) return;
+      if (chunk_.use_count() == 1 && chunk_->cap >= size) {
+        compact();
+        return;
+      }
+    }
+    move_chunk(size > base_ ? size : base_);
+  }
+
+  // give the chunk back once everything is read
+  void shrink() {
+    if (readable() > 0) return;
+    chunk_.reset();
+    clear();
+  }
+
+  // the first "\r\n" at or after readptr() + from, nullptr when none is
+  // read yet. the '\n' of 64 bytes are found in one vectorized pass and
+  // kept, so the short header lines of a pipeline share the pass
+  char *find_crlf(size_t from) {
+    size_t pos = read_ + from + 1;
+    while (pos < write_) {
+      if (pos < line_pos_ || pos >= line_pos_ + line_len_) {
+        index_lines(pos);
+        pos = line_pos_;
+      }
+
+      uint64_t bits = line_mask_ >> (pos - line_pos_);
+      if (bits == 0) {
+        pos = line_pos_ + line_len_;
+        continue;
+      }
+
+      pos += __builtin_ctzll(bits);
+      if (chunk_->data[pos - 1] == '\r') return chunk_->data + pos - 1;
+      pos++;
+    }
+    return nullptr;
   }
 
-  void expand() {
-    if (cap_ >= 0x10000) {
-      cap_ += 0x10000;
+  void append(const char *data, size_t size) {
+    if (writeable() < size) expand(size);
+    memcpy(writeptr(), data, size);
+    write_ += size;
+  }
+
+  void clear() {
+    read_ = write_ = 0;
+    line_len_ = 0;
+  }
+
+  void swap(ByteBuf &buf) {
+    std::swap(pool_, buf.pool_);
+    std::swap(category_, buf.category_);
+    chunk_.swap(buf.chunk_);
+    std::swap(base_, buf.base_);
+    std::swap(read_, buf.read_);
+    std::swap(write_, buf.write_);
+    std::swap(line_pos_, buf.line_pos_);
+    std::swap(line_len_, buf.line_len_);
+    std::swap(line_mask_, buf.line_mask_);
+  }
+
+ private:
+  static size_t grow(size_t cap) {
+    return cap >= 0x10000 ? cap + 0x10000 : cap * 2;
+  }
+
+  void compact() {
+    memmove(chunk_->data, chunk_->data + read_, readable());
+    write_ -= read_;
+    read_ = 0;
+    line_len_ = 0;
+  }
+
+  // index the '\n' of the written bytes from pos, 64 at most. 64 bytes
+  // without one skip to the next '\n' of the long line, found at the speed
+  // of StrchrVec, the index may start past pos then
+  void index_lines(size_t pos) {
+    char *data = chunk_->data;
+    size_t len = write_ - pos;
+    if (len >= 64) {
+      line_mask_ = CharMask64(data + pos, '\n');
+      if (line_mask_ == 0 && len > 128) {
+        char *lf = StrchrVec(data + pos + 64, len - 64, '\n');
+        pos = write_ - 64;
+        if (lf != nullptr && (size_t)(lf - data) < pos) pos = lf - data;
+        line_mask_ = CharMask64(data + pos, '\n');
+      }
+      len = 64;
     } else {
-      cap_ *= 2;
+      line_mask_ = 0;
+      for (size_t i = 0; i < len; i++) {
+        if (data[pos + i] == '\n') line_mask_ |= 1ULL << i;
+      }
     }
-    data_ = (char *)realloc(data_, cap_);
+    line_pos_ = pos;
+    line_len_ = len;
+  }
+
+  void move_chunk(size_t cap) {
+    ChunkPtr chunk = (pool_ != nullptr && cap == base_)
+                         ? pool_->Get(category_)
+                         : std::make_shared<ByteChunk>(cap, category_);
+    if (readable() > 0) memcpy(chunk->data, readptr(), readable());
+    write_ -= read_;
+    read_ = 0;
+    line_len_ = 0;
+    chunk_ = std::move(chunk);
   }
 
  private:
-  char *data_;
-  size_t cap_;
+  ChunkPool *pool_;
+  MemCategory category_;
+  ChunkPtr chunk_;
+  size_t base_;
   size_t read_, write_;
+
+  // the '\n' of [line_pos_, line_pos_ + line_len_) of the chunk, bit i for
+  // line_pos_ + i
+  size_t line_pos_, line_len_;
+  uint64_t line_mask_;
 };
 
 }  // namespace rockin
-#endif
\ No newline at end of file
+#endif
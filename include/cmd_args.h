@@ -22,9 +22,30 @@ class CmdArgs : public std::enable_shared_from_this<CmdArgs> {
   BufPtr ParseMultiCommand(ByteBuf &buf);
   BufPtr ParseInlineCommand(ByteBuf &buf);
 
+  char *FindLine(ByteBuf &buf);
+
+  void AddSlice(const ChunkPtr &chunk, char *data, size_t len);
+
  private:
+  // the read chunks of a multi bulk command, every argument is a view of
+  // them which keeps them alive until it is released
+  struct ArgSlices {
+    std::atomic<uint32_t> refs;
+    std::vector<ChunkPtr> chunks;
+
+    ArgSlices() : refs(1) {}
+    static void Free(ArgSlices *slices) { delete slices; }
+  };
+
   std::vector<BufPtr> args_;
+  RefPtr<ArgSlices> slices_;
   int mbulk_;
+
+  // length of the bulk whose header is consumed, -1 before its header
+  int64_t bulk_;
+
+  // bytes from readptr already scanned for the line end
+  size_t scan_;
 };
 
 }  // namespace rockin
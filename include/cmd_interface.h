@@ -26,36 +26,69 @@
     SET_META_EXPIRE(begin, expire);                                 \
   } while (0)
 
-// data key header
-// | key type |  key len  |   key    |  version  |
-// |  1 byte  |   2 byte  |   n byte |   4 byte  |
+// db key, a key of the db selected by the connection, which is the meta
+// key and the key of the cache and the workers. the keys of a db are one
+// range of each column family
+// | db index |   key    |
+// |  1 byte  |  n byte  |
+
+#define DB_NUM 16
+
+#define DB_KEY_SIZE(n) (1 + (n))
+#define DB_KEY_INDEX(begin) DecodeFixed8((const char *)(begin))
+
+#define SET_DB_KEY(begin, db, key, len)    \
+  do {                                     \
+    EncodeFixed8((char *)(begin), db);     \
+    memcpy((char *)(begin) + 1, key, len); \
+  } while (0)
+
+// data key header, made of a db key of n bytes
+// | db index | key type |  key len  |    key     |  version  |
+// |  1 byte  |  1 byte  |   2 byte  | n - 1 byte |   4 byte  |
 
 #define STRING_FLAG 'S'
 
 #define BASE_FIELD_KEY_SIZE(n) (7 + (n))
-#define FIELD_KEY_LNE(begin) DecodeFixed16((const char *)(begin) + 1)
-#define FIELD_KEY_START(begin) ((const char *)(begin) + 3)
+#define FIELD_KEY_DB(begin) DecodeFixed8((const char *)(begin))
+#define FIELD_KEY_LNE(begin) DecodeFixed16((const char *)(begin) + 2)
+#define FIELD_KEY_START(begin) ((const char *)(begin) + 4)
 #define FIELD_KEY_VERSION(begin) \
-  DecodeFixed32((const char *)(begin) + (FIELD_KEY_LNE(begin) + 3))
-
-#define SET_FIELD_KEY_HEADER(type, begin, key, len, version) \
-  do {                                                       \
-    EncodeFixed8((char *)(begin), type);                     \
-    EncodeFixed16((char *)(begin) + 1, len);                 \
-    memcpy((char *)(begin) + 3, key, len);                   \
-    EncodeFixed32((char *)(begin) + (len + 3), version);     \
+  DecodeFixed32((const char *)(begin) + (FIELD_KEY_LNE(begin) + 4))
+
+#define SET_FIELD_KEY_HEADER(type, begin, key, len, version)           \
+  do {                                                                 \
+    EncodeFixed8((char *)(begin), *(const char *)(key));               \
+    EncodeFixed8((char *)(begin) + 1, type);                           \
+    EncodeFixed16((char *)(begin) + 2, (len)-1);                       \
+    memcpy((char *)(begin) + 4, (const char *)(key) + 1, (len)-1);     \
+    EncodeFixed32((char *)(begin) + ((len) + 3), version);             \
   } while (0)
 
 namespace rockin {
 class CmdArgs;
 class RockinConn;
 
+// the keys of a command are the args from first_key to last_key every
+// key_step, last_key counts from the end when negative. first_key is 0 for
+// a command without keys
 struct CmdInfo {
   std::string name;
   int arity;
+  int first_key;
+  int last_key;
+  int key_step;
 
-  CmdInfo() : arity(0) {}
-  CmdInfo(std::string name_, int arity_) : name(name_), arity(arity_) {}
+  CmdInfo() : arity(0), first_key(0), last_key(0), key_step(0) {}
+  CmdInfo(std::string name_, int arity_)
+      : name(name_), arity(arity_), first_key(0), last_key(0), key_step(0) {}
+  CmdInfo(std::string name_, int arity_, int first_key_, int last_key_,
+          int key_step_)
+      : name(name_),
+        arity(arity_),
+        first_key(first_key_),
+        last_key(last_key_),
+        key_step(key_step_) {}
 };
 
 class Cmd {
@@ -16,6 +16,9 @@ extern BufPtrs ReplyError(BufPtr err);
 
 extern BufPtrs ReplyTypeError();
 
+// a rocksdb write failed, nothing of the command is persisted
+extern BufPtrs ReplyWriteError();
+
 extern BufPtrs ReplyString(BufPtr str);
 
 extern BufPtrs ReplyInteger(int64_t num);
@@ -24,5 +27,5 @@ extern BufPtrs ReplyBulk(BufPtr str);
 
 extern BufPtrs ReplyArray(BufPtrs &values);
 
-extern BufPtrs ReplyObj(std::shared_ptr<object_t> obj);
+extern BufPtrs ReplyObj(ObjPtr obj);
 }  // namespace rockin
\ No newline at end of file
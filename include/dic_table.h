@@ -58,6 +58,7 @@ class DicTable {
     return nullptr;
   }
 
+  // unlink and free the node of key, nodes are allocated by new
   bool Delete(std::shared_ptr<T> key) {
     if (table_[0]->used + table_[1]->used == 0) {
       return false;
@@ -77,7 +78,8 @@ class DicTable {
           } else {
             prev->next = node->next;
           }
-          node->next = nullptr;
+          table_[i]->used--;
+          delete node;
           return true;
         }
         prev = node;
@@ -93,6 +95,11 @@ class DicTable {
   }
 
   void Insert(Node* node) {
+    RehashStep();
+    Add(node);
+  }
+
+  void Add(Node* node) {
     this->Expand();
 
     uint64_t idx = hash_(node->data) & table_[0]->sizemask;
@@ -140,7 +147,7 @@ class DicTable {
       Node* node = table_[1]->head[rehashidx_];
       while (node) {
         Node* next_ = node->next;
-        Insert(node);
+        Add(node);
         table_[1]->used--;
         node = next_;
       }
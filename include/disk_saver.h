@@ -1,27 +1,68 @@
 #pragma once
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <vector>
 #include "async.h"
 #include "mem_alloc.h"
 
-struct uv__work;
-
 namespace rocksdb {
 class Cache;
-}
+}  // namespace rocksdb
 
 namespace rockin {
 struct DiskDB;
 
+// how the wal of a partition write reaches the disk
+enum WalMode {
+  Wal_Always = 0,    // fsync every request, requests are not merged
+  Wal_Group = 1,     // fsync every merged batch
+  Wal_EverySec = 2,  // fsync from a background thread every interval
+  Wal_None = 3,      // no wal, for cache-only deployments
+};
+
+// a put into the meta or the data column family, a delete when value is
+// nullptr
+struct DiskWriteOp {
+  bool meta;
+  BufPtr key;
+  BufPtr value;
+};
+
+typedef std::vector<DiskWriteOp> DiskWriteOps;
+
+// writes of many keys committed together by DiskSaver::Write, the puts of
+// each partition touched go to its writer as one request
+class DiskWriteBatch {
+ public:
+  DiskWriteBatch() {}
+
+  void SetMeta(BufPtr mkey, BufPtr meta);
+  void SetValues(BufPtr mkey, const KVPairS &kvs);
+  void DeleteValues(BufPtr mkey, const BufPtrs &keys);
+
+ private:
+  friend class DiskSaver;
+  DiskWriteOps &GetOps(BufPtr mkey);
+
+ private:
+  std::vector<DiskWriteOps> parts_;
+};
+
+struct DiskWriteReq;
+
+// requests waiting for the writer of one partition, the writer merges them
+// into one rocksdb WriteBatch and wakes them on done_cond once committed
 struct WriteAsyncQueue {
   QUEUE queue;
   uv_cond_t cond;
+  uv_cond_t done_cond;
   uv_mutex_t mutex;
-  std::vector<QUEUE *> queues;
-  uint64_t snum;
+  size_t bytes;
+  uint64_t snum;  // batches committed
+  uint64_t rnum;  // requests committed
 
-  WriteAsyncQueue() : snum(0) {
+  WriteAsyncQueue() : bytes(0), snum(0), rnum(0) {
     // init mutex
     int retcode = uv_mutex_init(&mutex);
     LOG_IF(FATAL, retcode) << "uv_mutex_init errer:" << GetUvError(retcode);
@@ -29,6 +70,8 @@ struct WriteAsyncQueue {
     // init cond
     retcode = uv_cond_init(&cond);
     LOG_IF(FATAL, retcode) << "uv_cond_init errer:" << GetUvError(retcode);
+    retcode = uv_cond_init(&done_cond);
+    LOG_IF(FATAL, retcode) << "uv_cond_init errer:" << GetUvError(retcode);
 
     // init queue
     QUEUE_INIT(&queue);
@@ -52,21 +95,71 @@ class DiskSaver {
   std::vector<std::string> GetValues(BufPtr mkey, std::vector<BufPtr> keys,
                                      std::vector<bool> &exists);
 
+  // get metas, one MultiGet per partition
+  std::vector<std::string> GetMetas(const BufPtrs &mkeys,
+                                    std::vector<bool> &exists);
+
+  // get values, keys[i] is a field of mkeys[i], one MultiGet per partition
+  std::vector<std::string> GetValues(const BufPtrs &mkeys, const BufPtrs &keys,
+                                     std::vector<bool> &exists);
+
   bool Set(BufPtr mkey, BufPtr meta);
   bool Set(BufPtr mkey, KVPairS kvs);
   bool Set(BufPtr mkey, BufPtr meta, KVPairS kvs);
 
+  // commit the puts of each partition atomically, merged with the writes
+  // of other threads, return after the commit
+  bool Write(DiskWriteBatch &batch);
+
+  // delete every key of every partition, after the writes queued before,
+  // by range deletes instead of iterating the keys
+  bool Flush();
+
+  // delete the keys of one db, its range of each column family
+  bool FlushDB(int db);
+
+  // keys of each db estimated by rocksdb, deleted keys whose meta is kept
+  // are counted too
+  std::vector<uint64_t> EstimateDBKeys();
+
   void Compact();
 
+  // persistence stats in INFO format
+  std::string Info();
+
  private:
+  friend class DiskWriteBatch;
   DiskDB *GetDB(BufPtr key);
-  void WriteBatch(int idx, const std::vector<uv__work *> &works);
+  size_t GetPartition(BufPtr key);
+
+  // MultiGet keys in one column family of each partition, grouped by
+  // the partition of mkeys[i]
+  std::vector<std::string> MultiGet(bool meta, const BufPtrs &mkeys,
+                                    const BufPtrs &keys,
+                                    std::vector<bool> &exists);
+
+  // writer thread of partition idx
+  void WriteLoop(size_t idx);
+  void WriteBatch(size_t idx, const std::vector<DiskWriteReq *> &reqs);
+  bool Write(DiskWriteBatch &batch, bool flush, int db);
+  bool FlushPartition(size_t idx, int db);
+  void WriteDone(WriteAsyncQueue *wq, const std::vector<DiskWriteReq *> &reqs,
+                 bool ok);
+
+  // fsync the wal of every partition each interval in Wal_EverySec mode
+  void SyncLoop();
 
  private:
   std::string path_;
   size_t partition_num_;
 
   std::vector<DiskDB *> dbs_;
+  std::vector<WriteAsyncQueue *> write_queues_;
+  std::vector<uv_thread_t> write_threads_;
+
+  WalMode wal_mode_;
+  std::atomic<uint64_t> wal_syncs_;
+  uv_thread_t sync_thread_;
   std::shared_ptr<rocksdb::Cache> meta_cache_;
   std::shared_ptr<rocksdb::Cache> data_cache_;
 };
@@ -1,11 +1,13 @@
 #pragma once
 #include <uv.h>
 #include <queue>
+#include "byte_buf.h"
 #include "safe_queue.h"
 #include "utils.h"
 
 namespace rockin {
 class SyncData;
+class RockinConn;
 class EventLoop {
  public:
   EventLoop();
@@ -21,9 +23,17 @@ class EventLoop {
   void RunInLoopNoWait(LoopCallback callback, std::shared_ptr<void> arg);
   void RunInLoopAndWait(LoopCallback callback, std::shared_ptr<void> arg);
 
+  // flush conn's output before the loop polls again, call in loop thread
+  void AddFlushConn(std::shared_ptr<RockinConn> conn);
+
+  // buffer chunks of the loop's connections
+  ChunkPool *chunk_pool() { return &chunk_pool_; }
+
  private:
   void RunLoop();
   void RunInLoop();
+  void Push(SyncData *sd);
+  void FlushConns();
 
  private:
   uv_loop_t loop_;
@@ -32,5 +42,10 @@ class EventLoop {
 
   uv_async_t async_;
   SafeQueue<SyncData> queue_;
+
+  uv_prepare_t prepare_;
+  std::vector<std::shared_ptr<RockinConn>> flush_conns_, flushing_conns_;
+
+  ChunkPool chunk_pool_;
 };
 }  // namespace rockin
@@ -0,0 +1,86 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "utils.h"
+
+#define SKETCH_MIN_SIZE 1024
+#define SKETCH_SAMPLE_FACTOR 10
+
+namespace rockin {
+
+// count-min sketch of 4-bit counters estimating how often a hash was seen
+// lately. each word holds 16 counters, 4 for each of the 4 rows, so an
+// item touches one word per row. all counters are halved after a sample of
+// SKETCH_SAMPLE_FACTOR times the size, old popularity fades out
+class FrequencySketch {
+ public:
+  FrequencySketch() : mask_(0), additions_(0), sample_size_(0) {
+    Resize(SKETCH_MIN_SIZE);
+  }
+
+  // size for about items distinct hashes, the counters are cleared when
+  // the sketch grows
+  void EnsureCapacity(size_t items) {
+    if (items > table_.size()) Resize(items);
+  }
+
+  void Increment(uint64_t hash) {
+    bool added = false;
+    for (int i = 0; i < 4; i++) {
+      uint64_t &word = table_[Index(hash, i)];
+      int shift = Shift(hash, i);
+      if (((word >> shift) & 0xF) < 0xF) {
+        word += 1ULL << shift;
+        added = true;
+      }
+    }
+
+    if (added && ++additions_ >= sample_size_) Reset();
+  }
+
+  int Frequency(uint64_t hash) {
+    int freq = 0xF;
+    for (int i = 0; i < 4; i++) {
+      int count = (table_[Index(hash, i)] >> Shift(hash, i)) & 0xF;
+      if (count < freq) freq = count;
+    }
+    return freq;
+  }
+
+ private:
+  void Resize(size_t items) {
+    size_t size = NextPower(items < SKETCH_MIN_SIZE ? SKETCH_MIN_SIZE : items);
+    table_.assign(size, 0);
+    mask_ = size - 1;
+    additions_ = 0;
+    sample_size_ = size * SKETCH_SAMPLE_FACTOR;
+  }
+
+  // the word of row i, by double hashing
+  size_t Index(uint64_t hash, int i) {
+    uint64_t h = hash + i * ((hash >> 32) | 1);
+    h ^= h >> 29;
+    return h & mask_;
+  }
+
+  // the counter of row i in its word
+  int Shift(uint64_t hash, int i) {
+    return (i * 4 + ((hash >> (56 + i * 2)) & 3)) * 4;
+  }
+
+  void Reset() {
+    for (size_t i = 0; i < table_.size(); i++) {
+      table_[i] = (table_[i] >> 1) & 0x7777777777777777ULL;
+    }
+    additions_ /= 2;
+  }
+
+ private:
+  std::vector<uint64_t> table_;
+  size_t mask_;
+  size_t additions_;
+  size_t sample_size_;
+};
+
+}  // namespace rockin
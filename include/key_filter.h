@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+
+#define KEY_FILTER_MAX_STAGES 32
+
+namespace rockin {
+
+// keys that may have a meta in a partition, a scalable blocked bloom
+// filter: the probes of a key fall in one cache line, and a stage of twice
+// the capacity is added when the last one is full. one thread adds keys
+// while any thread checks them. keys are never removed, a key removed from
+// rocksdb is only a false positive
+class KeyFilter {
+ public:
+  KeyFilter(size_t capacity, int bits_per_key);
+  ~KeyFilter();
+
+  void Add(uint64_t hash);
+
+  // false when the key was never added
+  bool MayContain(uint64_t hash);
+
+  // forget every key, call in the thread adding keys. the stages are kept
+  // for the threads checking keys meanwhile
+  void Clear();
+
+  size_t keys() { return keys_.load(std::memory_order_relaxed); }
+  size_t memory() { return memory_.load(std::memory_order_relaxed); }
+
+ private:
+  struct alignas(64) Line {
+    std::atomic<uint64_t> words[8];
+  };
+
+  struct Stage {
+    Line *lines;
+    size_t mask;
+    size_t capacity;
+    size_t keys;
+  };
+
+  Stage *NewStage(size_t capacity);
+
+ private:
+  int bits_per_key_;
+  int probes_;
+  std::atomic<Stage *> stages_[KEY_FILTER_MAX_STAGES];
+  std::atomic<int> stage_num_;
+  std::atomic<size_t> keys_;
+  std::atomic<size_t> memory_;
+};
+
+}  // namespace rockin
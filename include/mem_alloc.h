@@ -2,87 +2,196 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <new>
+#include <string>
 #include <type_traits>
 #include <vector>
 
 namespace rockin {
 
-// change used memory size
-extern void change_momory_size(size_t size);
+// what memory is used for, reported by INFO
+enum MemCategory {
+  Mem_Other = 0,  // everything else, like the free chunks of pools
+  Mem_Args,       // read buffers and parsed arguments
+  Mem_Replies,    // replies and output buffers
+  Mem_Objects,    // objects and the values they hold
+  Mem_Disk,       // keys and values written to rocksdb
+  Mem_Categories,
+};
+
+// change used memory size of category. every thread counts on its own
+// counters, which are summed when read
+extern void change_momory_size(MemCategory category, int64_t size);
+
+// get used memory size of category
+extern int64_t get_memory_size(MemCategory category);
 
 // get used memory size
 extern uint64_t get_memory_size();
 
-struct buffer_t {
-  char *data;
-  size_t len;
-  bool alloc;
+// memory stats in INFO format
+extern std::string memory_info();
 
-  buffer_t() : data(nullptr), len(0), alloc(false) {}
+// intrusive reference of T, which holds an atomic refs and frees itself by
+// a static Free when the last reference is dropped
+template <typename T>
+class RefPtr {
+ public:
+  RefPtr() : ptr_(nullptr) {}
+  RefPtr(std::nullptr_t) : ptr_(nullptr) {}
 
-  buffer_t(size_t l) : len(l), alloc(true) {
-    //..
-    data = (char *)malloc(l);
-  }
+  // adopt a new T whose refs is 1
+  explicit RefPtr(T *ptr) : ptr_(ptr) {}
 
-  buffer_t(const std::string &str) : alloc(true) {
-    len = str.length();
-    data = (char *)malloc(len);
-    memcpy(data, str.c_str(), len);
+  RefPtr(const RefPtr &r) : ptr_(r.ptr_) {
+    if (ptr_ != nullptr) ptr_->refs.fetch_add(1, std::memory_order_relaxed);
   }
 
-  buffer_t(std::string &&str) : alloc(true) {
-    len = str.length();
-    data = (char *)malloc(len);
-    memcpy(data, str.c_str(), len);
-  }
+  RefPtr(RefPtr &&r) : ptr_(r.ptr_) { r.ptr_ = nullptr; }
+
+  ~RefPtr() { reset(); }
 
-  buffer_t(char *d, size_t l) : len(l), alloc(true) {
-    data = (char *)malloc(l);
-    memcpy(data, d, l);
+  RefPtr &operator=(const RefPtr &r) {
+    RefPtr(r).swap(*this);
+    return *this;
   }
 
-  buffer_t(std::shared_ptr<buffer_t> buf) : len(buf->len), alloc(true) {
-    data = (char *)malloc(buf->len);
-    memcpy(data, buf->data, buf->len);
+  RefPtr &operator=(RefPtr &&r) {
+    RefPtr(std::move(r)).swap(*this);
+    return *this;
   }
 
-  buffer_t(size_t l, std::shared_ptr<buffer_t> buf) : len(l), alloc(true) {
-    data = (char *)malloc(l);
-    memcpy(data, buf->data, l > buf->len ? buf->len : l);
+  void reset() {
+    if (ptr_ != nullptr &&
+        ptr_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      T::Free(ptr_);
+    }
+    ptr_ = nullptr;
   }
 
-  ~buffer_t() {
-    if (alloc && data != nullptr) free(data);
+  void swap(RefPtr &r) { std::swap(ptr_, r.ptr_); }
+
+  // give up the reference without dropping it
+  T *release() {
+    T *ptr = ptr_;
+    ptr_ = nullptr;
+    return ptr;
   }
 
+  T *get() const { return ptr_; }
+  T *operator->() const { return ptr_; }
+  T &operator*() const { return *ptr_; }
+  explicit operator bool() const { return ptr_ != nullptr; }
+
+  bool operator==(const RefPtr &r) const { return ptr_ == r.ptr_; }
+  bool operator!=(const RefPtr &r) const { return ptr_ != r.ptr_; }
+  bool operator==(std::nullptr_t) const { return ptr_ == nullptr; }
+  bool operator!=(std::nullptr_t) const { return ptr_ != nullptr; }
+
+ private:
+  T *ptr_;
+};
+
+// a block of at least size bytes from the slabs of the calling thread, cls
+// is its size class. a block larger than the largest class is malloc'ed
+extern void *slab_alloc(size_t size, uint8_t &cls);
+
+// give back a block of slab_alloc, in any thread
+extern void slab_free(void *ptr, uint8_t cls);
+
+// a buffer in one allocation: the header with its refcount, then the
+// payload. a view has no payload, it points into the bytes of an owner
+// which it keeps referenced
+struct buffer_t {
+  std::atomic<uint32_t> refs;
+  uint8_t cls;
+  uint8_t category;
+  bool alloc;  // the payload follows the header
+  char *data;
+  size_t len;
+  void *owner;
+  void (*unref)(void *owner);
+
   bool operator==(const buffer_t &b) const {
-    if (len != b.len) return false;
-    for (size_t i = 0; i < len; i++) {
-      if (*((char *)data + i) != *((char *)b.data + i)) {
-        return false;
-      }
-    }
-    return true;
+    return len == b.len && memcmp(data, b.data, len) == 0;
+  }
+
+  size_t Size() { return sizeof(buffer_t) + (alloc ? len : 0); }
+
+  static void Free(buffer_t *buf) {
+    if (buf->owner != nullptr) buf->unref(buf->owner);
+    change_momory_size((MemCategory)buf->category, -(int64_t)buf->Size());
+    slab_free(buf, buf->cls);
   }
 };
 
-typedef std::shared_ptr<buffer_t> BufPtr;
+typedef RefPtr<buffer_t> BufPtr;
 typedef std::vector<BufPtr> BufPtrs;
 typedef std::vector<std::pair<BufPtr, BufPtr>> KVPairS;
 
-template <typename... _Args>
-std::shared_ptr<buffer_t> make_buffer(_Args &&... __args) {
-  std::shared_ptr<buffer_t> ptr(
-      new buffer_t(std::forward<_Args>(__args)...), [](buffer_t *ptr) {
-        change_momory_size(0 - (sizeof(buffer_t) + ptr->len));
-        delete ptr;
-      });
+inline buffer_t *new_buffer(size_t payload, MemCategory category) {
+  uint8_t cls;
+  buffer_t *buf = (buffer_t *)slab_alloc(sizeof(buffer_t) + payload, cls);
+  buf->refs.store(1, std::memory_order_relaxed);
+  buf->cls = cls;
+  buf->category = category;
+  buf->alloc = true;
+  buf->data = (char *)(buf + 1);
+  buf->len = payload;
+  buf->owner = nullptr;
+  buf->unref = nullptr;
+  change_momory_size(category, buf->Size());
+  return buf;
+}
 
-  change_momory_size((sizeof(buffer_t) + ptr->len));
-  return ptr;
+// a buffer of l bytes, not initialized
+inline BufPtr make_buffer(size_t l, MemCategory category = Mem_Other) {
+  return BufPtr(new_buffer(l, category));
+}
+
+inline BufPtr make_buffer(const char *d, size_t l,
+                          MemCategory category = Mem_Other) {
+  buffer_t *buf = new_buffer(l, category);
+  memcpy(buf->data, d, l);
+  return BufPtr(buf);
+}
+
+inline BufPtr make_buffer(const char *str, MemCategory category = Mem_Other) {
+  return make_buffer(str, strlen(str), category);
+}
+
+inline BufPtr make_buffer(const std::string &str,
+                          MemCategory category = Mem_Other) {
+  return make_buffer(str.data(), str.length(), category);
+}
+
+inline BufPtr make_buffer(const BufPtr &buf,
+                          MemCategory category = Mem_Other) {
+  return make_buffer(buf->data, buf->len, category);
+}
+
+// a buffer of l bytes beginning with the ones of buf
+inline BufPtr make_buffer(size_t l, const BufPtr &buf,
+                          MemCategory category = Mem_Other) {
+  buffer_t *nbuf = new_buffer(l, category);
+  memcpy(nbuf->data, buf->data, l > buf->len ? buf->len : l);
+  return BufPtr(nbuf);
+}
+
+// len bytes at data of owner, which is referenced until the view is freed
+template <typename T>
+BufPtr make_view(const RefPtr<T> &owner, char *data, size_t len,
+                 MemCategory category = Mem_Other) {
+  buffer_t *buf = new_buffer(0, category);
+  buf->alloc = false;
+  buf->data = data;
+  buf->len = len;
+  buf->owner = RefPtr<T>(owner).release();
+  buf->unref = [](void *owner) { RefPtr<T> drop((T *)owner); };
+  return BufPtr(buf);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -101,56 +210,88 @@ enum EncodeType {
   Encode_Int = 2,
 };
 
+// values up to this size are copied into their object, larger ones are
+// referenced
+#define OBJ_INLINE_VALUE_SIZE 64
+
+// an object in one allocation: the header, the key and an inline value.
+// integers are inlined as int64, a larger value is referenced unless it
+// is a slice of another buffer. the value never changes once the object
+// is shared, an update makes a new object
 struct object_t {
-  uint8_t type;
-  uint8_t encode;
+  std::atomic<uint32_t> refs;
   uint32_t version;
   uint64_t expire;
-  BufPtr key;
-  std::shared_ptr<void> value;
-  std::shared_ptr<object_t> next;
-
-  object_t()
-      : type(0),
-        encode(0),
-        version(0),
-        expire(0),
-        key(nullptr),
-        value(nullptr),
-        next(nullptr) {}
-
-  object_t(BufPtr key_)
-      : type(0),
-        encode(0),
-        version(0),
-        expire(0),
-        key(key_),
-        value(nullptr),
-        next(nullptr) {}
-
-  size_t Size() { return sizeof(object_t); }
+  uint32_t key_len;
+  uint32_t value_len;  // of the inline value
+  BufPtr value;        // a referenced value, nullptr when inline
+  uint8_t type;
+  uint8_t encode;
+  uint8_t cls;
+
+  // the key follows the header, then the inline value
+  char *key_data() { return (char *)(this + 1); }
+  char *value_data() {
+    return value != nullptr ? value->data : key_data() + key_len;
+  }
+  size_t value_size() { return value != nullptr ? value->len : value_len; }
+
+  // bytes of the allocation
+  size_t Size() { return sizeof(object_t) + key_len + value_len; }
+
+  static void Free(object_t *obj) {
+    size_t size = obj->Size();
+    uint8_t cls = obj->cls;
+    obj->~object_t();
+    change_momory_size(Mem_Objects, -(int64_t)size);
+    slab_free(obj, cls);
+  }
 };
 
-typedef std::shared_ptr<object_t> ObjPtr;
+typedef RefPtr<object_t> ObjPtr;
 typedef std::vector<ObjPtr> ObjPtrs;
 
-template <typename... _Args>
-ObjPtr make_object(_Args &&... __args) {
-  ObjPtr ptr(new object_t(std::forward<_Args>(__args)...), [](object_t *ptr) {
-    change_momory_size(0 - sizeof(buffer_t));
+// an object of key with room for an inline value of value_len bytes, the
+// caller fills value_data() before sharing it
+inline ObjPtr make_object(const char *key, size_t key_len,
+                          size_t value_len = 0) {
+  uint8_t cls;
+  size_t size = sizeof(object_t) + key_len + value_len;
+  object_t *obj = new (slab_alloc(size, cls)) object_t();
+  obj->refs.store(1, std::memory_order_relaxed);
+  obj->version = 0;
+  obj->expire = 0;
+  obj->key_len = key_len;
+  obj->value_len = value_len;
+  obj->type = Type_None;
+  obj->encode = Encode_None;
+  obj->cls = cls;
+  memcpy(obj->key_data(), key, key_len);
+  change_momory_size(Mem_Objects, size);
+  return ObjPtr(obj);
+}
+
+inline ObjPtr make_object(BufPtr key) {
+  return make_object(key->data, key->len);
+}
 
-    delete ptr;
-  });
+// an object of key holding value, inline when small or a slice
+inline ObjPtr make_object(BufPtr key, BufPtr value) {
+  if (value->len <= OBJ_INLINE_VALUE_SIZE || !value->alloc) {
+    auto obj = make_object(key->data, key->len, value->len);
+    memcpy(obj->value_data(), value->data, value->len);
+    return obj;
+  }
 
-  change_momory_size(sizeof(buffer_t));
-  return ptr;
+  auto obj = make_object(key->data, key->len);
+  obj->value = value;
+  return obj;
 }
 
-#define OBJ_SET_VALUE(o, v, t, e) \
-  do {                            \
-    (o)->type = (t);              \
-    (o)->encode = (e);            \
-    (o)->value = (v);             \
-  } while (0)
+// the value of obj as a buffer, an inline value is viewed in place
+inline BufPtr object_value(ObjPtr obj) {
+  if (obj->value != nullptr) return obj->value;
+  return make_view(obj, obj->value_data(), obj->value_len, Mem_Replies);
+}
 
 }  // namespace rockin
\ No newline at end of file
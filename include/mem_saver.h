@@ -1,11 +1,16 @@
 #pragma once
 #include <uv.h>
+#include <string>
+#include <vector>
 #include "async.h"
 #include "mem_alloc.h"
 
 namespace rockin {
-struct MemAsyncQueue;
+class MemCache;
 
+// hot objects cached in memory by each worker. a key is always handled by
+// the same worker, so every worker owns its cache and uses it without
+// locks. the cache is write through, rocksdb always has the objects
 class MemSaver {
  public:
   static MemSaver *Default();
@@ -13,25 +18,48 @@ class MemSaver {
   MemSaver();
   ~MemSaver();
 
-  bool Init();
+  // call in worker idx, builds the cache of the thread
+  bool Init(int idx, size_t worker_num);
 
-  // get obj from memsaver
+  // get obj from memsaver, nullptr when not cached or expired
   ObjPtr GetObj(BufPtr key);
 
   // get objs from memsaver
   ObjPtrs GetObj(BufPtrs keys);
 
-  // insert obj to memsaver
+  // insert obj to memsaver, or replace the cached obj of its key
   void InsertObj(ObjPtr obj);
 
   // insert obj to memsaver
   void InsertObj(ObjPtrs obj);
 
-  // update expire
-  void UpdateExpire(ObjPtr obj, uint64_t expire_ms);
+  // update the expire of the cached obj of key, the key is handed to the
+  // active expire of the worker when the time comes
+  void UpdateExpire(BufPtr key, uint64_t expire_ms);
+
+  // up to max keys whose expire passed by now, they may have been updated
+  // since, the caller checks them
+  BufPtrs GetExpiredKeys(uint64_t now, size_t max);
+
+  // drop the cached obj of key
+  void DeleteObj(BufPtr key);
+
+  // drop every cached obj and pending expire of the worker
+  void Clear();
+
+  // drop the cached objs of one db
+  void ClearDB(int db);
+
+  // cache stats in INFO format
+  std::string Info();
+
+ private:
+  MemCache *GetCache();
 
  private:
   uv_key_t key_;
+  uv_mutex_t mutex_;
+  std::vector<MemCache *> caches_;
 };
 
-}  // namespace rockin
\ No newline at end of file
+}  // namespace rockin
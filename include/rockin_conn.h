@@ -1,5 +1,6 @@
 #pragma once
 #include <uv.h>
+#include <deque>
 #include <functional>
 #include <vector>
 #include "byte_buf.h"
@@ -7,7 +8,6 @@
 #include "utils.h"
 
 namespace rockin {
-class object_t;
 class CmdArgs;
 
 class RockinConn : public std::enable_shared_from_this<RockinConn> {
@@ -21,7 +21,27 @@ class RockinConn : public std::enable_shared_from_this<RockinConn> {
 
   void Close();
 
-  bool WriteData(std::vector<BufPtr> &&datas);
+  // replies go out in command order: every parsed command takes a sequence
+  // and its reply waits until the commands before it are answered. a reply
+  // is complete when the dispatch and every async work holding it are done
+
+  // sequence of the command being dispatched
+  uint64_t cur_seq() { return cur_seq_; }
+
+  // an async work answers for seq, released when the work is done
+  void HoldReply(uint64_t seq);
+  void ReleaseReply(uint64_t seq);
+
+  // append datas to the reply of seq, flushed before the next loop poll
+  bool WriteData(uint64_t seq, std::vector<BufPtr> &&datas);
+
+  // append datas to the reply of the command being dispatched
+  bool WriteData(std::vector<BufPtr> &&datas) {
+    return WriteData(cur_seq_, std::move(datas));
+  }
+
+  // write the buffered output to the socket
+  void Flush();
 
   uv_tcp_t *handle() { return t_; }
   uv_loop_t *loop() { return (t_ == nullptr ? nullptr : t_->loop); }
@@ -40,16 +60,47 @@ class RockinConn : public std::enable_shared_from_this<RockinConn> {
   void ReplyInteger(int64_t num);
   void ReplyBulk(BufPtr str);
   void ReplyArray(std::vector<BufPtr> &values);
-  void ReplyObj(std::shared_ptr<object_t> obj);
+  void ReplyObj(ObjPtr obj);
 
  private:
   void OnAlloc(size_t suggested_size, uv_buf_t *buf);
   void OnRead(ssize_t nread, const uv_buf_t *buf);
+  static void OnWrite(uv_write_t *req, int status);
+
+  uint64_t BeginReply();
+  void AppendOutput(std::vector<BufPtr> &datas);
+
+  // stop reading and close once all taken replies are written
+  void CloseAfterReplies();
+  void CloseIfDone();
 
  private:
+  // large data is referenced by the output, not copied
+  struct WriteRef {
+    size_t offset;
+    BufPtr data;
+  };
+
+  struct PendingReply {
+    int holds;
+    std::vector<BufPtr> datas;
+  };
+
   int index_;
   uv_tcp_t *t_;
   ByteBuf buf_;
   std::shared_ptr<CmdArgs> cmd_args_;
+
+  // replies_[i] is the reply of sequence reply_seq_ + i
+  uint64_t cur_seq_, reply_seq_;
+  std::deque<PendingReply> replies_;
+  bool close_after_;
+
+  ByteBuf wbuf_, flush_buf_;
+  std::vector<WriteRef> wrefs_, flush_refs_;
+  std::vector<uv_buf_t> iovs_;
+  uv_write_t write_req_;
+  bool writing_, flush_pending_;
+  std::shared_ptr<RockinConn> write_self_;
 };
 }  // namespace rockin
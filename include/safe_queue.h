@@ -1,68 +1,77 @@
 #pragma once
-#include <pthread.h>
-#include <uv.h>
-#include "stdlib.h"
+#include <stdlib.h>
+#include <atomic>
 #include "utils.h"
 
 namespace rockin {
 
-class SpinLock {
- public:
-  SpinLock() { uv_mutex_init(&lock_); }
-
-  void Lock() {
-    for (int i = 0; i < 1000; i++) {
-      if (uv_mutex_trylock(&lock_) == 0) return;
-    }
-    uv_mutex_lock(&lock_);
-  }
-
-  void UnLock() { uv_mutex_unlock(&lock_); }
-
- private:
-  uv_mutex_t lock_;
-};
-
+// bounded lock-free queue, any thread pushes and one thread pops. each cell
+// carries a sequence telling whether it is free for the producer at that
+// position or filled for the consumer
 template <typename T>
 class SafeQueue {
  public:
   SafeQueue(size_t size) {
     size_ = NextPower(size);
-    queue_ = (T**)malloc(sizeof(T*) * size_);
-    tail_ = head_ = 0;
     mask_ = size_ - 1;
+    cells_ = new Cell[size_];
+    for (size_t i = 0; i < size_; i++) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+      cells_[i].data = nullptr;
+    }
+    head_.store(0, std::memory_order_relaxed);
+    tail_ = 0;
   }
 
-  bool Push(T* d) {
-    if ((head_ & mask_) - (tail_ & mask_) >= size_) {
-      return false;
-    }
+  ~SafeQueue() { delete[] cells_; }
 
-    lock_.Lock();
-    queue_[head_ & mask_] = d;
-    head_++;
-    lock_.UnLock();
+  size_t capacity() { return size_; }
 
-    return true;
+  // false when the queue is full
+  bool Push(T *d) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell *cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell->data = d;
+          cell->seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
   }
 
-  T* Pop() {
-    if ((tail_ & mask_) >= (head_ & mask_)) {
+  // call in the consumer thread only, nullptr when empty or the next
+  // producer has not finished
+  T *Pop() {
+    Cell *cell = &cells_[tail_ & mask_];
+    if (cell->seq.load(std::memory_order_acquire) != tail_ + 1) {
       return nullptr;
     }
 
-    lock_.Lock();
-    T* d = queue_[tail_ & mask_];
+    T *d = cell->data;
+    cell->seq.store(tail_ + size_, std::memory_order_release);
     tail_++;
-    lock_.UnLock();
-
     return d;
   }
 
  private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T *data;
+  };
+
   size_t size_, mask_;
-  volatile size_t tail_, head_;
-  T** queue_;
-  SpinLock lock_;
+  Cell *cells_;
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) size_t tail_;
 };
 }  // namespace rockin
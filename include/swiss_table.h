@@ -0,0 +1,241 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SWISS_TABLE_SSE2 1
+#endif
+
+#define SWISS_GROUP_SIZE 16
+#define SWISS_MIN_CAPACITY 16
+
+// groups moved to the new table by each find or insert while resizing
+#define SWISS_MIGRATE_GROUPS 2
+
+namespace rockin {
+
+// open addressing hash table of T. every slot has a control byte: empty,
+// deleted, or the low 7 bits of the hash of its element, and a group of 16
+// control bytes is matched at once by SSE2. a table over 7/8 load moves
+// into a larger one a few groups per call, like the rehash of DicTable,
+// so no call rehashes everything. Hash and Equal are called inline, Find
+// and Erase take any key type both accept
+template <typename T, typename Hash, typename Equal>
+class SwissTable {
+ public:
+  SwissTable() : size_(0), migrate_(0) {
+    Init(cur_, 0);
+    Init(old_, 0);
+  }
+
+  ~SwissTable() {
+    Free(cur_);
+    Free(old_);
+  }
+
+  size_t Size() { return size_; }
+
+  // drop every element at once
+  void Clear() {
+    Free(cur_);
+    Free(old_);
+    size_ = 0;
+    migrate_ = 0;
+  }
+
+  // the stored element equal to key, or nullptr. it is valid until the
+  // next call, which may move it
+  template <typename K>
+  T *Find(const K &key) {
+    Migrate();
+
+    uint64_t hash = hash_(key);
+    T *slot = Lookup(cur_, hash, key);
+    if (slot == nullptr && old_.capacity > 0) slot = Lookup(old_, hash, key);
+    return slot;
+  }
+
+  // false when an equal element is stored
+  bool Insert(const T &value) {
+    if (Find(value) != nullptr) return false;
+
+    if (cur_.used + cur_.deleted >= cur_.growth) Grow();
+    Place(cur_, hash_(value), value);
+    size_++;
+    return true;
+  }
+
+  template <typename K>
+  bool Erase(const K &key) {
+    uint64_t hash = hash_(key);
+    if (Remove(cur_, hash, key) ||
+        (old_.capacity > 0 && Remove(old_, hash, key))) {
+      size_--;
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  static const int8_t kEmpty = -128;
+  static const int8_t kDeleted = -2;
+
+  struct Table {
+    int8_t *ctrl;
+    T *slots;
+    size_t capacity;
+    size_t mask;  // groups - 1
+    size_t used;
+    size_t deleted;
+    size_t growth;  // used + deleted that triggers a resize
+  };
+
+  static void Init(Table &t, size_t capacity) {
+    t.ctrl = nullptr;
+    t.slots = nullptr;
+    t.capacity = capacity;
+    t.mask = capacity / SWISS_GROUP_SIZE - 1;
+    t.used = t.deleted = 0;
+    t.growth = capacity / 8 * 7;
+    if (capacity > 0) {
+      t.ctrl = (int8_t *)aligned_alloc(SWISS_GROUP_SIZE, capacity);
+      memset(t.ctrl, kEmpty, capacity);
+      t.slots = new T[capacity];
+    }
+  }
+
+  static void Free(Table &t) {
+    free(t.ctrl);
+    delete[] t.slots;
+    Init(t, 0);
+  }
+
+  // bit i is set when control byte i of the group is c
+  static inline uint32_t Match(const int8_t *group, int8_t c) {
+#ifdef SWISS_TABLE_SSE2
+    __m128i g = _mm_load_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < SWISS_GROUP_SIZE; i++) {
+      if (group[i] == c) mask |= 1u << i;
+    }
+    return mask;
+#endif
+  }
+
+  // empty and deleted slots, the only negative control bytes
+  static inline uint32_t MatchFree(const int8_t *group) {
+#ifdef SWISS_TABLE_SSE2
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < SWISS_GROUP_SIZE; i++) {
+      if (group[i] < 0) mask |= 1u << i;
+    }
+    return mask;
+#endif
+  }
+
+  static inline int8_t H2(uint64_t hash) { return hash & 0x7F; }
+  static inline size_t H1(uint64_t hash) { return hash >> 7; }
+
+  // groups are probed by triangular steps, which visit every group of a
+  // power of two table
+  template <typename K>
+  T *Lookup(Table &t, uint64_t hash, const K &key) {
+    if (t.capacity == 0) return nullptr;
+
+    size_t g = H1(hash) & t.mask;
+    for (size_t i = 1;; i++) {
+      const int8_t *group = t.ctrl + g * SWISS_GROUP_SIZE;
+      for (uint32_t m = Match(group, H2(hash)); m != 0; m &= m - 1) {
+        T &slot = t.slots[g * SWISS_GROUP_SIZE + __builtin_ctz(m)];
+        if (equal_(slot, key)) return &slot;
+      }
+      if (Match(group, kEmpty) != 0) return nullptr;
+      g = (g + i) & t.mask;
+    }
+  }
+
+  static void Place(Table &t, uint64_t hash, const T &value) {
+    size_t g = H1(hash) & t.mask;
+    for (size_t i = 1;; i++) {
+      int8_t *group = t.ctrl + g * SWISS_GROUP_SIZE;
+      uint32_t m = MatchFree(group);
+      if (m != 0) {
+        int j = __builtin_ctz(m);
+        if (group[j] == kDeleted) t.deleted--;
+        group[j] = H2(hash);
+        t.slots[g * SWISS_GROUP_SIZE + j] = value;
+        t.used++;
+        return;
+      }
+      g = (g + i) & t.mask;
+    }
+  }
+
+  template <typename K>
+  bool Remove(Table &t, uint64_t hash, const K &key) {
+    T *slot = Lookup(t, hash, key);
+    if (slot == nullptr) return false;
+
+    // a lookup already stops at a group with an empty slot, so the slot
+    // may become empty, otherwise later probes must pass it
+    size_t idx = slot - t.slots;
+    int8_t *group = t.ctrl + idx / SWISS_GROUP_SIZE * SWISS_GROUP_SIZE;
+    if (Match(group, kEmpty) != 0) {
+      t.ctrl[idx] = kEmpty;
+    } else {
+      t.ctrl[idx] = kDeleted;
+      t.deleted++;
+    }
+    *slot = T();
+    t.used--;
+    return true;
+  }
+
+  void Grow() {
+    // a resize still moving finishes first
+    while (old_.capacity > 0) Migrate();
+
+    // the new table is at most 7/16 full, so it takes every insert made
+    // while the old one is moved
+    size_t capacity = SWISS_MIN_CAPACITY;
+    while (capacity / 16 * 7 <= size_) capacity *= 2;
+
+    old_ = cur_;
+    Init(cur_, capacity);
+    migrate_ = 0;
+  }
+
+  void Migrate() {
+    if (old_.capacity == 0) return;
+
+    for (int n = 0; n < SWISS_MIGRATE_GROUPS && migrate_ <= old_.mask; n++) {
+      size_t base = migrate_ * SWISS_GROUP_SIZE;
+      for (int j = 0; j < SWISS_GROUP_SIZE; j++) {
+        if (old_.ctrl[base + j] < 0) continue;
+        Place(cur_, hash_(old_.slots[base + j]), old_.slots[base + j]);
+
+        // moved slots keep the probes of the old table going
+        old_.ctrl[base + j] = kDeleted;
+        old_.slots[base + j] = T();
+        old_.used--;
+      }
+      migrate_++;
+    }
+
+    if (migrate_ > old_.mask) Free(old_);
+  }
+
+ private:
+  Table cur_, old_;
+  size_t size_;
+  size_t migrate_;
+  Hash hash_;
+  Equal equal_;
+};
+
+}  // namespace rockin
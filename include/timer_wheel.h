@@ -0,0 +1,246 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem_alloc.h"
+#include "siphash.h"
+#include "swiss_table.h"
+#include "utils.h"
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 5
+
+// delays up to about 12 days have a slot of their own
+#define TIMER_WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+namespace rockin {
+
+// keys waiting for their expire time in milliseconds, a hierarchical
+// timing wheel. level i has 64 slots of 64^i ms each, a key goes to the
+// level whose span covers its delay and moves down when the slots below
+// wrap around, so an add is O(1) and a tick touches one slot. a key is in
+// the wheel once, found by its index: a later time is only recorded and
+// the key moves when its slot comes up, an earlier one moves it at once.
+// one thread uses a wheel
+class TimerWheel {
+ public:
+  TimerWheel() : now_(GetMilliSec()), size_(0), due_count_(0) {
+    memset(slots_, 0, sizeof(slots_));
+    due_head_ = due_tail_ = nullptr;
+  }
+
+  ~TimerWheel() { Clear(); }
+
+  void Clear() {
+    for (int i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+      for (int j = 0; j < TIMER_WHEEL_SLOTS; j++) {
+        FreeList(slots_[i][j]);
+        slots_[i][j] = nullptr;
+      }
+    }
+    FreeList(due_head_);
+    due_head_ = due_tail_ = nullptr;
+    index_.Clear();
+    size_ = due_count_ = 0;
+  }
+
+  // keys in the wheel, due ones included
+  size_t Size() { return size_; }
+
+  void Add(const char *key, size_t len, uint64_t expire) {
+    uint64_t hash = rockin::Hash(key, len);
+    Entry **found = index_.Find(KeyRef{key, len, hash});
+    if (found != nullptr) {
+      Entry *entry = *found;
+      bool earlier = expire < entry->expire;
+      entry->expire = expire;
+
+      // a due key with a later time is placed again when it is taken
+      if (earlier && !entry->due) {
+        Unlink(entry);
+        Place(entry);
+      }
+      return;
+    }
+
+    Entry *entry = (Entry *)malloc(sizeof(Entry) + len);
+    entry->hash = hash;
+    entry->expire = expire;
+    entry->len = len;
+    memcpy(entry->key(), key, len);
+    change_momory_size(Mem_Other, Charge(entry));
+
+    index_.Insert(entry);
+    Place(entry);
+    size_++;
+  }
+
+  // take up to max keys due by now, the others stay for the next call
+  size_t Expire(uint64_t now, size_t max, BufPtrs &keys) {
+    while (due_count_ < max && now_ <= now) {
+      // nothing is waiting in the slots, skip the empty ticks
+      if (due_count_ == size_) {
+        now_ = now + 1;
+        break;
+      }
+      Tick();
+    }
+
+    size_t n = 0;
+    while (n < max && due_head_ != nullptr) {
+      Entry *entry = due_head_;
+      due_head_ = entry->next;
+      if (due_head_ == nullptr) due_tail_ = nullptr;
+      due_count_--;
+      entry->due = false;
+
+      // added again with a later time since it was due, now_ is at most
+      // one tick after now, so it goes to a slot
+      if (entry->expire > now) {
+        Place(entry);
+        continue;
+      }
+
+      index_.Erase(KeyRef{entry->key(), entry->len, entry->hash});
+      size_--;
+      keys.push_back(make_buffer(entry->key(), entry->len, Mem_Disk));
+      Free(entry);
+      n++;
+    }
+    return n;
+  }
+
+ private:
+  // pprev points to the link to the entry in its slot, unused in the due
+  // list, which is only taken from its head
+  struct Entry {
+    Entry *next;
+    Entry **pprev;
+    uint64_t hash;
+    uint64_t expire;
+    uint32_t len;
+    bool due;
+
+    char *key() { return (char *)(this + 1); }
+  };
+
+  struct KeyRef {
+    const char *data;
+    size_t len;
+    uint64_t hash;
+  };
+
+  struct EntryHash {
+    uint64_t operator()(const Entry *entry) const { return entry->hash; }
+    uint64_t operator()(const KeyRef &key) const { return key.hash; }
+  };
+
+  struct EntryEqual {
+    bool operator()(Entry *a, const Entry *b) const {
+      return a->len == b->len && memcmp(a->key(), (char *)(b + 1), a->len) == 0;
+    }
+    bool operator()(Entry *a, const KeyRef &key) const {
+      return a->len == key.len && memcmp(a->key(), key.data, key.len) == 0;
+    }
+  };
+
+  // the entry and its slot of the index
+  static size_t Charge(Entry *entry) {
+    return sizeof(Entry) + entry->len + sizeof(Entry *) + 1;
+  }
+
+  static void Free(Entry *entry) {
+    change_momory_size(Mem_Other, -(int64_t)Charge(entry));
+    free(entry);
+  }
+
+  static void FreeList(Entry *entry) {
+    while (entry != nullptr) {
+      Entry *next = entry->next;
+      Free(entry);
+      entry = next;
+    }
+  }
+
+  void PushDue(Entry *entry) {
+    entry->next = nullptr;
+    entry->due = true;
+    if (due_tail_ != nullptr)
+      due_tail_->next = entry;
+    else
+      due_head_ = entry;
+    due_tail_ = entry;
+    due_count_++;
+  }
+
+  // a key beyond the last level waits in its farthest slot, and is placed
+  // again when that slot comes up
+  void Place(Entry *entry) {
+    if (entry->expire < now_) {
+      PushDue(entry);
+      return;
+    }
+
+    uint64_t expire = entry->expire;
+    if (expire - now_ >= TIMER_WHEEL_SPAN) expire = now_ + TIMER_WHEEL_SPAN - 1;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           expire - now_ >= 1ULL << (TIMER_WHEEL_BITS * (level + 1))) {
+      level++;
+    }
+
+    Entry *&slot = slots_[level][(expire >> (TIMER_WHEEL_BITS * level)) &
+                                 (TIMER_WHEEL_SLOTS - 1)];
+    entry->next = slot;
+    entry->pprev = &slot;
+    entry->due = false;
+    if (slot != nullptr) slot->pprev = &entry->next;
+    slot = entry;
+  }
+
+  static void Unlink(Entry *entry) {
+    *entry->pprev = entry->next;
+    if (entry->next != nullptr) entry->next->pprev = entry->pprev;
+  }
+
+  // the slot of level 0 for now_, after the slots of the upper levels that
+  // end at now_ are spread over the levels below
+  void Tick() {
+    size_t index = now_ & (TIMER_WHEEL_SLOTS - 1);
+    for (int level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++) {
+      index = (now_ >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+      Entry *entry = slots_[level][index];
+      slots_[level][index] = nullptr;
+      while (entry != nullptr) {
+        Entry *next = entry->next;
+        Place(entry);
+        entry = next;
+      }
+    }
+
+    Entry *&slot = slots_[0][now_ & (TIMER_WHEEL_SLOTS - 1)];
+    Entry *entry = slot;
+    slot = nullptr;
+    while (entry != nullptr) {
+      Entry *next = entry->next;
+      if (entry->expire > now_)
+        Place(entry);
+      else
+        PushDue(entry);
+      entry = next;
+    }
+    now_++;
+  }
+
+ private:
+  Entry *slots_[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  Entry *due_head_, *due_tail_;
+  SwissTable<Entry *, EntryHash, EntryEqual> index_;
+  uint64_t now_;  // the next tick
+  size_t size_;
+  size_t due_count_;
+};
+
+}  // namespace rockin
@@ -18,6 +18,11 @@ struct MultiResult {
       : cnt(cnt_), error(false), int_value(0), str_values(cnt_) {}
 };
 
+// delete up to max keys of the calling worker whose expire passed by now,
+// with their bulks up to a bound scaled by max, return the number of keys
+// taken from its timer wheel
+size_t ActiveExpire(uint64_t now, size_t max);
+
 // COMMAND
 class CommandCmd : public Cmd, public std::enable_shared_from_this<CommandCmd> {
  public:
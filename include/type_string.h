@@ -9,7 +9,11 @@
 namespace rockin {
 class RockinConn;
 class CmdArgs;
-class object_t;
+struct object_t;
+
+// the data keys of the bulks of a string by its meta, none for a meta of
+// another type
+BufPtrs GetStringValueKeys(BufPtr mkey, const std::string &meta);
 
 // GET key
 class GetCmd : public Cmd, public std::enable_shared_from_this<GetCmd> {
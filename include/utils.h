@@ -65,20 +65,41 @@ extern bool SetKeepAlive(int sock);
 // set socket no delay
 extern bool SetNoDelay(int sock);
 
+// vectorized scan by SSE2 or AVX2 when the cpu has it
+extern char *StrchrVec(char *s, size_t l, char c);
+extern char *Strchr2Vec(char *s, size_t l, char c1, char c2);
+
+// protocol lines are mostly shorter than this, scanned byte by byte
+// before paying for a vectorized call
+#define STRCHR_SHORT_SIZE 16
+
+// find the first c in s[0, l)
 inline char *Strchr(char *s, size_t l, char c) {
-  for (size_t i = 0; i < l; ++i) {
+  size_t n = l < STRCHR_SHORT_SIZE ? l : STRCHR_SHORT_SIZE;
+  for (size_t i = 0; i < n; ++i) {
     if (s[i] == c) return s + i;
   }
-  return nullptr;
+  if (l <= STRCHR_SHORT_SIZE) return nullptr;
+  return StrchrVec(s + STRCHR_SHORT_SIZE, l - STRCHR_SHORT_SIZE, c);
 }
 
+// find the first c1 followed by c2 in s[0, l)
 inline char *Strchr2(char *s, size_t l, char c1, char c2) {
-  for (size_t i = 1; i < l; ++i) {
+  size_t n = l < STRCHR_SHORT_SIZE + 1 ? l : STRCHR_SHORT_SIZE + 1;
+  for (size_t i = 1; i < n; ++i) {
     if (s[i - 1] == c1 && s[i] == c2) return s + (i - 1);
   }
-  return nullptr;
+  if (l <= STRCHR_SHORT_SIZE + 1) return nullptr;
+  return Strchr2Vec(s + STRCHR_SHORT_SIZE, l - STRCHR_SHORT_SIZE, c1, c2);
 }
 
+// bit i set when s[i] == c, for the 64 bytes of s
+extern uint64_t CharMask64(const char *s, char c);
+
+// the instruction set used by StrchrVec/Strchr2Vec/CharMask64:
+// avx2/sse2/scalar
+extern const char *StrchrImpl();
+
 // convert int64_t to string
 extern int Int64ToString(char *s, size_t len, int64_t value);
 extern std::string Int64ToString(int64_t value);
@@ -7,12 +7,16 @@
 #include "cmd_interface.h"
 
 namespace rockin {
+struct MultiWorkData;
+
 class Workers : public Async {
  public:
   static Workers *Default();
 
   bool Init(size_t thread_num);
 
+  size_t thread_num() const { return thread_num_; }
+
   void HandeCmd(std::shared_ptr<RockinConn> conn,
                 std::shared_ptr<CmdArgs> args);
 
@@ -23,9 +27,35 @@ class Workers : public Async {
                  std::function<ObjPtr(BufPtr)> mid_handle, BufPtr key,
                  std::function<BufPtrs(const ObjPtrs &)> handle);
 
+  // keys are grouped by their worker, group_handle runs once on each worker
+  // with the indexes of its keys, handle builds the reply in the loop thread
+  // after all groups are done
+  void AsyncWork(const BufPtrs &keys, std::shared_ptr<RockinConn> conn,
+                 std::function<void(const std::vector<size_t> &)> group_handle,
+                 std::function<BufPtrs()> handle);
+
+  // worker_handle runs once on every worker, handle builds the reply in the
+  // loop thread after all of them are done. the loop thread waits for room
+  // in a full queue, so either every worker runs worker_handle or none
+  // does, when the connection is gone
+  void AsyncWorkAll(std::shared_ptr<RockinConn> conn,
+                    std::function<void()> worker_handle,
+                    std::function<BufPtrs()> handle);
+
  private:
   void AsyncWork(int idx) override;
-  void PostWork(int idx, QUEUE *q) override;
+  bool PostWork(int idx, QUEUE *q, bool wait) override;
+
+  // all keys of a multi key work are done, run its handle
+  void MultiWorkDone(std::shared_ptr<MultiWorkData> data);
+
+  // run group_handle on the worker of each group, on every worker when all
+  // is set, even with an empty group, waiting for room in full queues
+  void AsyncGroups(
+      std::vector<std::vector<size_t>> &groups, bool all,
+      std::shared_ptr<RockinConn> conn,
+      std::function<void(const std::vector<size_t> &)> group_handle,
+      std::function<BufPtrs()> handle);
 
  private:
   size_t thread_num_;
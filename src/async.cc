@@ -1,6 +1,12 @@
 #include "async.h"
 #include <assert.h>
 #include <glog/logging.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <thread>
 #include "utils.h"
 
 #define uv__has_active_reqs(loop) ((loop)->active_reqs.count > 0)
@@ -35,53 +41,121 @@
     uv__req_register(loop, req);     \
   } while (0)
 
+// pops tried before a worker parks, adapted between the bounds by whether
+// spinning found work last time
+#define ASYNC_SPIN_MIN 16
+#define ASYNC_SPIN_MAX 4096
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_PAUSE() __builtin_ia32_pause()
+#else
+#define CPU_PAUSE() \
+  do {              \
+  } while (0)
+#endif
+
 namespace rockin {
 AsyncQueue::AsyncQueue(size_t max_size)
-    : max_size_(max_size), cur_size_(0), read_wait_(0), write_wait_(0) {
+    : queue_(max_size), parked_(0), spin_limit_(ASYNC_SPIN_MIN) {
+#ifndef __linux__
   // init mutex
   int retcode = uv_mutex_init(&mutex_);
   LOG_IF(FATAL, retcode) << "uv_mutex_init errer:" << GetUvError(retcode);
 
   // init cond
-  retcode = uv_cond_init(&read_cond_);
-  LOG_IF(FATAL, retcode) << "uv_cond_init errer:" << GetUvError(retcode);
-  retcode = uv_cond_init(&write_cond_);
+  retcode = uv_cond_init(&cond_);
   LOG_IF(FATAL, retcode) << "uv_cond_init errer:" << GetUvError(retcode);
+#endif
+}
 
-  // init queue
-  QUEUE_INIT(&queue_);
+AsyncQueue::~AsyncQueue() {
+#ifndef __linux__
+  uv_cond_destroy(&cond_);
+  uv_mutex_destroy(&mutex_);
+#endif
 }
 
-QUEUE *AsyncQueue::Pop() {
-  uv_mutex_lock(&mutex_);
-  while (QUEUE_EMPTY(&queue_)) {
-    read_wait_++;
-    uv_cond_wait(&read_cond_, &mutex_);
-    read_wait_--;
+QUEUE *AsyncQueue::Pop(uint64_t timeout_ms) {
+  uint64_t deadline = timeout_ms > 0 ? uv_hrtime() + timeout_ms * 1000000 : 0;
+  while (true) {
+    for (int i = 0; i < spin_limit_; i++) {
+      QUEUE *q = queue_.Pop();
+      if (q != nullptr) {
+        if (spin_limit_ < ASYNC_SPIN_MAX) spin_limit_ <<= 1;
+        return q;
+      }
+      CPU_PAUSE();
+    }
+    if (spin_limit_ > ASYNC_SPIN_MIN) spin_limit_ >>= 1;
+
+    // a producer checks parked_ after its push, so one of us sees the other
+    parked_.store(1, std::memory_order_seq_cst);
+    QUEUE *q = queue_.Pop();
+    if (q != nullptr) {
+      parked_.store(0, std::memory_order_relaxed);
+      return q;
+    }
+
+    if (deadline == 0) {
+      Park(0);
+      continue;
+    }
+
+    uint64_t now = uv_hrtime();
+    if (now >= deadline) {
+      parked_.store(0, std::memory_order_relaxed);
+      return nullptr;
+    }
+    Park(deadline - now);
   }
+}
 
-  QUEUE *q = QUEUE_HEAD(&queue_);
-  QUEUE_REMOVE(q);
-  cur_size_--;
-  if (write_wait_ > 0) uv_cond_signal(&write_cond_);
+bool AsyncQueue::TryPush(QUEUE *q) {
+  if (!queue_.Push(q)) {
+    return false;
+  }
 
-  uv_mutex_unlock(&mutex_);
-  return q;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (parked_.load(std::memory_order_relaxed) == 1 &&
+      parked_.exchange(0) == 1) {
+    Unpark();
+  }
+  return true;
 }
 
 void AsyncQueue::Push(QUEUE *q) {
+  while (!TryPush(q)) std::this_thread::yield();
+}
+
+#ifdef __linux__
+void AsyncQueue::Park(uint64_t timeout_ns) {
+  struct timespec ts;
+  ts.tv_sec = timeout_ns / 1000000000;
+  ts.tv_nsec = timeout_ns % 1000000000;
+  syscall(SYS_futex, &parked_, FUTEX_WAIT_PRIVATE, 1,
+          timeout_ns > 0 ? &ts : nullptr, nullptr, 0);
+}
+
+void AsyncQueue::Unpark() {
+  syscall(SYS_futex, &parked_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+#else
+void AsyncQueue::Park(uint64_t timeout_ns) {
   uv_mutex_lock(&mutex_);
-  while (cur_size_ >= max_size_) {
-    write_wait_++;
-    uv_cond_wait(&write_cond_, &mutex_);
-    write_wait_--;
+  if (timeout_ns > 0) {
+    if (parked_.load() == 1) uv_cond_timedwait(&cond_, &mutex_, timeout_ns);
+  } else {
+    while (parked_.load() == 1) uv_cond_wait(&cond_, &mutex_);
   }
+  uv_mutex_unlock(&mutex_);
+}
 
-  QUEUE_INSERT_TAIL(&queue_, q);
-  cur_size_++;
-  if (read_wait_ > 0) uv_cond_signal(&read_cond_);
+void AsyncQueue::Unpark() {
+  uv_mutex_lock(&mutex_);
+  uv_cond_signal(&cond_);
   uv_mutex_unlock(&mutex_);
 }
+#endif
 
 Async::Async() {
   int retcode = uv_sem_init(&start_sem_, 0);
@@ -141,7 +215,8 @@ static void uv__queue_done(struct uv__work *w, int err) {
 }
 
 int Async::AsyncQueueWork(int idx, uv_loop_t *loop, uv_work_t *req,
-                          uv_work_cb work_cb, uv_after_work_cb after_work_cb) {
+                          uv_work_cb work_cb, uv_after_work_cb after_work_cb,
+                          bool wait) {
   if (loop == nullptr) return -1;
 
   uv__req_init(loop, req, UV_WORK);
@@ -151,7 +226,10 @@ int Async::AsyncQueueWork(int idx, uv_loop_t *loop, uv_work_t *req,
   req->work_req.loop = loop;
   req->work_req.work = uv__queue_work;
   req->work_req.done = uv__queue_done;
-  this->PostWork(idx, &req->work_req.wq);
+  if (!this->PostWork(idx, &req->work_req.wq, wait)) {
+    uv__req_unregister(loop, req);
+    return UV_EBUSY;
+  }
   return 0;
 }
 
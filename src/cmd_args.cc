@@ -7,8 +7,13 @@
 #include "type_string.h"
 #include "utils.h"
 
+#define PROTO_INLINE_MAX_SIZE (1024 * 64)
+#define PROTO_MAX_MBULK (1024 * 64)
+#define PROTO_MAX_BULK_LEN (512LL * 1024 * 1024)
+#define PROTO_BIG_BULK_SIZE (1024 * 32)
+
 namespace rockin {
-CmdArgs::CmdArgs() : mbulk_(-1) {}
+CmdArgs::CmdArgs() : mbulk_(-1), bulk_(-1), scan_(0) {}
 
 BufPtr CmdArgs::Parse(ByteBuf &buf) {
   if (args_.size() == mbulk_) {
@@ -29,68 +34,114 @@ BufPtr CmdArgs::Parse(ByteBuf &buf) {
   return nullptr;
 }
 
+char *CmdArgs::FindLine(ByteBuf &buf) {
+  size_t len = buf.readable();
+  char *end = buf.find_crlf(scan_);
+  if (end == nullptr) {
+    // keep the last byte, it may be the '\r' of a split "\r\n"
+    scan_ = len > 0 ? len - 1 : 0;
+    return nullptr;
+  }
+
+  scan_ = 0;
+  return end;
+}
+
 BufPtr CmdArgs::ParseMultiCommand(ByteBuf &buf) {
-  char *ptr = buf.readptr();
-  if (*ptr == '*') {
-    char *end = Strchr2(ptr, buf.readable(), '\r', '\n');
+  if (mbulk_ < 0) {
+    char *ptr = buf.readptr();
+    char *end = FindLine(buf);
     if (end == nullptr) {
+      if (buf.readable() > PROTO_INLINE_MAX_SIZE) {
+        return make_buffer("ERR Protocol error: too big mbulk count string");
+      }
       return nullptr;
     }
 
-    mbulk_ = (int)StringToInt64(ptr + 1, end - ptr - 1);
-    if (mbulk_ <= 0 || mbulk_ > 1024 * 64) {
+    int64_t mbulk = 0;
+    if (StringToInt64(ptr + 1, end - ptr - 1, &mbulk) != 1 || mbulk <= 0 ||
+        mbulk > PROTO_MAX_MBULK) {
       std::ostringstream build;
       build << "ERR Protocol error: invalid multi bulk length:"
             << std::string(ptr + 1, end - ptr - 1);
       return make_buffer(build.str());
     }
 
+    mbulk_ = (int)mbulk;
     buf.move_readptr(end - ptr + 2);
+    slices_ = RefPtr<ArgSlices>(new ArgSlices());
+    args_.reserve(mbulk_);
   }
 
-  for (int i = args_.size(); i < mbulk_; i++) {
-    char *nptr = buf.readptr();
-    char *end = Strchr2(nptr, buf.readable(), '\r', '\n');
-    if (end == nullptr) {
-      return nullptr;
-    }
+  while (args_.size() < mbulk_) {
+    if (bulk_ < 0) {
+      char *nptr = buf.readptr();
+      char *end = FindLine(buf);
+      if (end == nullptr) {
+        if (buf.readable() > PROTO_INLINE_MAX_SIZE) {
+          return make_buffer("ERR Protocol error: too big bulk count string");
+        }
+        return nullptr;
+      }
 
-    if (*nptr != '$') {
-      std::ostringstream build;
-      build << "ERR Protocol error: expected '$', got '" << *nptr << "'";
-      return make_buffer(build.str());
-    }
+      if (*nptr != '$') {
+        std::ostringstream build;
+        build << "ERR Protocol error: expected '$', got '" << *nptr << "'";
+        return make_buffer(build.str());
+      }
 
-    int bulk = (int)StringToInt64(nptr + 1, end - nptr - 1);
-    if (bulk < 0 || bulk > 1024 * 1024) {
-      std::ostringstream build;
-      build << "ERR Protocol error: invalid bulk length:"
-            << std::string(nptr + 1, end - nptr - 1);
-      return make_buffer(build.str());
+      int64_t bulk = 0;
+      if (StringToInt64(nptr + 1, end - nptr - 1, &bulk) != 1 || bulk < 0 ||
+          bulk > PROTO_MAX_BULK_LEN) {
+        std::ostringstream build;
+        build << "ERR Protocol error: invalid bulk length:"
+              << std::string(nptr + 1, end - nptr - 1);
+        return make_buffer(build.str());
+      }
+
+      bulk_ = bulk;
+      buf.move_readptr(end - nptr + 2);
+
+      // the length is known, let the rest of a big bulk be read in place
+      if (bulk_ >= PROTO_BIG_BULK_SIZE) {
+        buf.reserve(bulk_ + 2);
+      }
     }
 
-    char *dptr = end + 2;
-    if (dptr - nptr + bulk + 2 > buf.readable()) {
+    if (buf.readable() < bulk_ + 2) {
       return nullptr;
     }
 
-    if (*(dptr + bulk) != '\r' || *(dptr + bulk + 1) != '\n') {
+    char *dptr = buf.readptr();
+    if (*(dptr + bulk_) != '\r' || *(dptr + bulk_ + 1) != '\n') {
       std::ostringstream build;
       build << "ERR Protocol error: invalid bulk length";
       return make_buffer(build.str());
     }
 
-    args_.push_back(make_buffer(dptr, bulk));
-    buf.move_readptr(dptr - nptr + bulk + 2);
+    AddSlice(buf.chunk(), dptr, bulk_);
+    buf.move_readptr(bulk_ + 2);
+    bulk_ = -1;
   }
 
   return nullptr;
 }
 
+void CmdArgs::AddSlice(const ChunkPtr &chunk, char *data, size_t len) {
+  if (slices_->chunks.empty() || slices_->chunks.back() != chunk) {
+    slices_->chunks.push_back(chunk);
+  }
+
+  args_.push_back(make_view(slices_, data, len, Mem_Args));
+}
+
 BufPtr CmdArgs::ParseInlineCommand(ByteBuf &buf) {
   char *ptr = buf.readptr();
-  char *end = Strchr2(ptr, buf.readable(), '\r', '\n');
+  char *end = FindLine(buf);
   if (end == nullptr) {
+    if (buf.readable() > PROTO_INLINE_MAX_SIZE) {
+      return make_buffer("ERR Protocol error: too big inline request");
+    }
     return nullptr;
   }
 
@@ -136,7 +187,7 @@ BufPtr CmdArgs::ParseInlineCommand(ByteBuf &buf) {
           ptr++;
         }
       }
-      args_.push_back(make_buffer(build.str()));
+      args_.push_back(make_buffer(build.str(), Mem_Args));
 
     } else if (*ptr == '\'') {
       ptr++;
@@ -153,14 +204,14 @@ BufPtr CmdArgs::ParseInlineCommand(ByteBuf &buf) {
           ptr++;
         }
       }
-      args_.push_back(make_buffer(build.str()));
+      args_.push_back(make_buffer(build.str(), Mem_Args));
 
     } else {
       char *space = Strchr(ptr, end - ptr, ' ');
       if (space == nullptr) {
         space = end;
       }
-      args_.push_back(make_buffer(ptr, space - ptr));
+      args_.push_back(make_buffer(ptr, space - ptr, Mem_Args));
       ptr = space;
     }
   }
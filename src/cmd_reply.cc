@@ -55,6 +55,14 @@ BufPtrs ReplyTypeError() {
   return std::move(datas);
 }
 
+BufPtrs ReplyWriteError() {
+  static BufPtr g_reply_write_err = make_buffer("-ERR write to disk fail\r\n");
+
+  BufPtrs datas;
+  datas.push_back(g_reply_write_err);
+  return std::move(datas);
+}
+
 BufPtrs ReplyString(BufPtr str) {
   if (str == nullptr) {
     return ReplyNil();
@@ -76,7 +84,7 @@ BufPtrs ReplyInteger(int64_t num) {
 
   BufPtrs datas;
   datas.push_back(g_begin_int);
-  datas.push_back(make_buffer(Int64ToString(num)));
+  datas.push_back(make_buffer(Int64ToString(num), Mem_Replies));
   datas.push_back(g_proto_split);
   return std::move(datas);
 }
@@ -91,7 +99,7 @@ BufPtrs ReplyBulk(BufPtr str) {
 
   BufPtrs datas;
   datas.push_back(g_begin_bulk);
-  datas.push_back(make_buffer(Int64ToString(str->len)));
+  datas.push_back(make_buffer(Int64ToString(str->len), Mem_Replies));
   datas.push_back(g_proto_split);
   datas.push_back(str);
   datas.push_back(g_proto_split);
@@ -106,14 +114,14 @@ BufPtrs ReplyArray(BufPtrs &values) {
 
   BufPtrs datas;
   datas.push_back(g_begin_array);
-  datas.push_back(make_buffer(Int64ToString(values.size())));
+  datas.push_back(make_buffer(Int64ToString(values.size()), Mem_Replies));
   datas.push_back(g_proto_split);
   for (size_t i = 0; i < values.size(); i++) {
     if (values[i] == nullptr) {
       datas.push_back(g_nil);
     } else {
       datas.push_back(g_begin_bulk);
-      datas.push_back(make_buffer(Int64ToString(values[i]->len)));
+      datas.push_back(make_buffer(Int64ToString(values[i]->len), Mem_Replies));
       datas.push_back(g_proto_split);
       datas.push_back(values[i]);
       datas.push_back(g_proto_split);
@@ -122,17 +130,44 @@ BufPtrs ReplyArray(BufPtrs &values) {
   return std::move(datas);
 }
 
-BufPtrs ReplyObj(std::shared_ptr<object_t> obj) {
+// a bulk of len bytes in one buffer
+static BufPtr SmallBulk(const char *data, size_t len) {
+  char num[32];
+  int n = Int64ToString(num, sizeof(num), len);
+  auto bulk = make_buffer(n + len + 5, Mem_Replies);
+  char *ptr = bulk->data;
+  *ptr++ = '$';
+  memcpy(ptr, num, n);
+  ptr += n;
+  *ptr++ = '\r';
+  *ptr++ = '\n';
+  memcpy(ptr, data, len);
+  ptr += len;
+  *ptr++ = '\r';
+  *ptr++ = '\n';
+  return bulk;
+}
+
+// the value of a string object as a bulk, an inline value is written with
+// its header in one buffer
+BufPtrs ReplyObj(ObjPtr obj) {
   if (obj == nullptr) {
     return ReplyNil();
-  } else if (obj->type == Type_String && obj->encode == Encode_Raw) {
-    auto str_value = std::static_pointer_cast<buffer_t>(obj->value);
-    return ReplyBulk(str_value);
-  } else if (obj->type == Type_String && obj->encode == Encode_Int) {
-    auto str_value = std::static_pointer_cast<buffer_t>(obj->value);
-    return ReplyInteger(*((int64_t *)str_value->data));
+  } else if (obj->type != Type_String) {
+    return BufPtrs();
   }
 
-  return BufPtrs();
+  BufPtrs datas;
+  if (obj->encode == Encode_Int) {
+    char num[32];
+    int n = Int64ToString(num, sizeof(num), *((int64_t *)obj->value_data()));
+    datas.push_back(SmallBulk(num, n));
+  } else if (obj->value == nullptr &&
+             obj->value_len <= OBJ_INLINE_VALUE_SIZE) {
+    datas.push_back(SmallBulk(obj->value_data(), obj->value_len));
+  } else {
+    return ReplyBulk(object_value(obj));
+  }
+  return std::move(datas);
 }
 }  // namespace rockin
\ No newline at end of file
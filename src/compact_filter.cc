@@ -56,12 +56,16 @@ bool DataCompactFilter::Filter(int level, const rocksdb::Slice& key,
   }
 
   size_t keylen = FIELD_KEY_LNE(key.data());
-  const char* data = FIELD_KEY_START(key.data());
   uint32_t version = FIELD_KEY_VERSION(key.data());
 
+  // the db key of the meta, the db index and the key are apart in the
+  // field key
+  std::string mkey(DB_KEY_SIZE(keylen), '\0');
+  SET_DB_KEY(&mkey[0], FIELD_KEY_DB(key.data()), FIELD_KEY_START(key.data()),
+             keylen);
+
   std::string meta;
-  auto status = db_->Get(rocksdb::ReadOptions(), handle_,
-                         rocksdb::Slice(data, keylen), &meta);
+  auto status = db_->Get(rocksdb::ReadOptions(), handle_, mkey, &meta);
 
   // not found metadata
   if (status.IsNotFound()) return true;
@@ -1,14 +1,44 @@
 #include "disk_saver.h"
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <rocksdb/convenience.h>
 #include <rocksdb/db.h>
 #include <rocksdb/table.h>
+#include <chrono>
 #include <mutex>
+#include <thread>
 
+#include "cmd_interface.h"
 #include "compact_filter.h"
+#include "key_filter.h"
 #include "rocksdb/filter_policy.h"
 #include "siphash.h"
 #include "utils.h"
 
+// the layout of the keys written, kept in the default column family of
+// every partition. 1 had no db index, 2 starts the meta and data keys with
+// the db index
+#define DISK_FORMAT_KEY "rockin_format_version"
+#define DISK_FORMAT_VERSION 2
+
+DEFINE_int32(write_batch_max_bytes, 4 << 20,
+             "max bytes of puts merged into one write of a partition");
+DEFINE_int32(write_batch_max_delay_us, 0,
+             "max microseconds a partition writer waits for more writes "
+             "before committing, 0 commits what is already queued");
+DEFINE_bool(key_filter, true,
+            "keep a filter of the meta keys of each partition in memory, "
+            "so lookups of keys that never existed skip rocksdb");
+DEFINE_int32(key_filter_bits_per_key, 10,
+             "bits of the key filter for each key, 10 gives about 1% false "
+             "positives");
+DEFINE_string(wal_mode, "everysec",
+              "wal durability: always fsyncs every write, group fsyncs every "
+              "merged batch, everysec fsyncs every wal_sync_interval_ms, "
+              "none disables the wal");
+DEFINE_int32(wal_sync_interval_ms, 1000,
+             "interval of the background wal fsync in everysec mode");
+
 namespace rockin {
 
 namespace {
@@ -35,9 +65,133 @@ struct DiskDB {
   rocksdb::ColumnFamilyHandle *db_handle;
   std::string partition_name;
   int partition_id;
+
+  // nullptr when disabled
+  KeyFilter *filter;
+  std::atomic<uint64_t> filter_negatives;
+  std::atomic<uint64_t> filter_false_positives;
+
+  DiskDB()
+      : db(nullptr),
+        mt_handle(nullptr),
+        db_handle(nullptr),
+        partition_id(0),
+        filter(nullptr),
+        filter_negatives(0),
+        filter_false_positives(0) {}
+};
+
+static inline uint64_t KeyHash(const char *data, size_t len) {
+  return rockin::Hash(data, len);
+}
+
+// false when the filter of the partition rules the meta key out
+static inline bool MayExist(DiskDB *diskDB, BufPtr mkey) {
+  if (diskDB->filter == nullptr ||
+      diskDB->filter->MayContain(KeyHash(mkey->data, mkey->len))) {
+    return true;
+  }
+  diskDB->filter_negatives.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+// fill the filter with every meta key of the partition. expired keys are
+// kept by the compaction filter as Type_None metas, so a new object of the
+// key continues its version, and they stay in the filter too. the only
+// metas dropped by compaction are malformed ones, left as false positives
+static void BuildKeyFilter(DiskDB *diskDB) {
+  uint64_t estimate = 0;
+  diskDB->db->GetIntProperty(diskDB->mt_handle,
+                             rocksdb::DB::Properties::kEstimateNumKeys,
+                             &estimate);
+
+  // room to grow before the filter adds a stage
+  size_t capacity = estimate * 2;
+  if (capacity < (1 << 20)) capacity = 1 << 20;
+  diskDB->filter = new KeyFilter(capacity, FLAGS_key_filter_bits_per_key);
+
+  uint64_t start = GetMilliSec();
+  rocksdb::ReadOptions ops;
+  ops.fill_cache = false;
+  rocksdb::Iterator *iter = diskDB->db->NewIterator(ops, diskDB->mt_handle);
+  for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+    rocksdb::Slice key = iter->key();
+    diskDB->filter->Add(KeyHash(key.data(), key.size()));
+  }
+  LOG_IF(FATAL, !iter->status().ok())
+      << "build key filter:" << iter->status().ToString();
+  delete iter;
+
+  LOG(INFO) << "key filter of " << diskDB->partition_name << ":"
+            << diskDB->filter->keys() << " keys, "
+            << GetSizeString(diskDB->filter->memory()) << ", "
+            << GetMilliSec() - start << "ms";
+}
+
+// a partition without the format record is new, or of format 1 when it
+// has keys. data of another format is refused, it would be read with the
+// wrong layout and the compaction filter would drop its values
+static void CheckFormat(DiskDB *diskDB, rocksdb::ColumnFamilyHandle *handle) {
+  std::string value;
+  auto status =
+      diskDB->db->Get(rocksdb::ReadOptions(), handle, DISK_FORMAT_KEY, &value);
+  LOG_IF(FATAL, !status.ok() && !status.IsNotFound())
+      << "rocksdb Get format:" << status.ToString();
+
+  int version = 0;
+  if (status.ok()) {
+    version = atoi(value.c_str());
+  } else {
+    rocksdb::ColumnFamilyHandle *handles[] = {diskDB->mt_handle,
+                                              diskDB->db_handle};
+    for (int i = 0; i < 2 && version == 0; i++) {
+      rocksdb::Iterator *iter =
+          diskDB->db->NewIterator(rocksdb::ReadOptions(), handles[i]);
+      iter->SeekToFirst();
+      if (iter->Valid()) version = 1;
+      delete iter;
+    }
+  }
+
+  LOG_IF(FATAL, version != 0 && version != DISK_FORMAT_VERSION)
+      << diskDB->partition_name << " has data of format " << version
+      << ", expect " << DISK_FORMAT_VERSION << ", migrate or remove it";
+  if (version != 0) return;
+
+  rocksdb::WriteOptions ops;
+  ops.sync = true;
+  status = diskDB->db->Put(ops, handle, DISK_FORMAT_KEY,
+                           std::to_string(DISK_FORMAT_VERSION));
+  LOG_IF(FATAL, !status.ok()) << "rocksdb Put format:" << status.ToString();
+}
+
+// a DiskWriteBatch part queued to the writer of its partition
+struct DiskWriteReq {
+  QUEUE wq;
+  DiskWriteOps *ops;
+  size_t bytes;
+  bool flush;  // delete the partition instead, in a batch of its own
+  int db;      // the db deleted by a flush, -1 for every db
+  bool done;
+  bool ok;
 };
 
-DiskSaver::DiskSaver() : partition_num_(0) {}
+static const char *WalModeName(WalMode mode) {
+  switch (mode) {
+    case Wal_Always:
+      return "always";
+    case Wal_Group:
+      return "group";
+    case Wal_EverySec:
+      return "everysec";
+    case Wal_None:
+      return "none";
+  }
+  return "unknown";
+}
+
+DiskSaver::DiskSaver()
+    : partition_num_(0), wal_mode_(Wal_EverySec), wal_syncs_(0) {}
 
 DiskSaver::~DiskSaver() {
   LOG(INFO) << "destroy rocks pool...";
@@ -48,6 +202,19 @@ bool DiskSaver::Init(int partition_num, const std::string &path) {
   path_ = path;
   partition_num_ = partition_num;
 
+  if (FLAGS_wal_mode == "always") {
+    wal_mode_ = Wal_Always;
+  } else if (FLAGS_wal_mode == "group") {
+    wal_mode_ = Wal_Group;
+  } else if (FLAGS_wal_mode == "everysec") {
+    wal_mode_ = Wal_EverySec;
+  } else if (FLAGS_wal_mode == "none") {
+    wal_mode_ = Wal_None;
+  } else {
+    LOG(FATAL) << "unknown wal_mode:" << FLAGS_wal_mode;
+  }
+  LOG(INFO) << "wal mode:" << WalModeName(wal_mode_);
+
   rocksdb::Env *env = rocksdb::Env::Default();
   env->SetBackgroundThreads(2, rocksdb::Env::LOW);
   env->SetBackgroundThreads(1, rocksdb::Env::HIGH);
@@ -122,16 +289,48 @@ bool DiskSaver::Init(int partition_num, const std::string &path) {
     db->mt_handle = handles[0];
     db->db_handle = handles[1];
     LOG(INFO) << "open rocksdb:" << partition_name;
+    CheckFormat(db, handles[2]);
+    if (FLAGS_key_filter) BuildKeyFilter(db);
     dbs_.push_back(db);
   }
 
+  struct _thread_data {
+    DiskSaver *ptr;
+    size_t idx;
+    _thread_data(DiskSaver *p, size_t i) : ptr(p), idx(i) {}
+  };
+
+  for (int i = 0; i < partition_num; i++) {
+    write_queues_.push_back(new WriteAsyncQueue());
+
+    uv_thread_t tid;
+    _thread_data *data = new _thread_data(this, i);
+    int retcode = uv_thread_create(&tid,
+                                   [](void *arg) {
+                                     _thread_data *data = (_thread_data *)arg;
+                                     data->ptr->WriteLoop(data->idx);
+                                     delete data;
+                                   },
+                                   data);
+    LOG_IF(FATAL, retcode) << "uv_thread_create error:" << GetUvError(retcode);
+    write_threads_.push_back(tid);
+  }
+
+  if (wal_mode_ == Wal_EverySec) {
+    int retcode = uv_thread_create(
+        &sync_thread_, [](void *arg) { ((DiskSaver *)arg)->SyncLoop(); },
+        this);
+    LOG_IF(FATAL, retcode) << "uv_thread_create error:" << GetUvError(retcode);
+  }
+
   return true;
 }
 
-DiskDB *DiskSaver::GetDB(BufPtr key) {
-  if (DiskSaver::Default()->partition_num_ == 1) return dbs_[0];
-  int index = rockin::SimpleHash(key->data, key->len) % partition_num_;
-  return dbs_[index];
+DiskDB *DiskSaver::GetDB(BufPtr key) { return dbs_[GetPartition(key)]; }
+
+size_t DiskSaver::GetPartition(BufPtr key) {
+  if (partition_num_ == 1) return 0;
+  return rockin::SimpleHash(key->data, key->len) % partition_num_;
 }
 
 static bool GetFromRocksdb(rocksdb::DB *db, rocksdb::ColumnFamilyHandle *handle,
@@ -163,6 +362,7 @@ static bool GetFromRocksdb(rocksdb::DB *db, rocksdb::ColumnFamilyHandle *handle,
 
 std::string DiskSaver::GetMeta(BufPtr mkey, bool &exist) {
   DiskDB *diskDB = this->GetDB(mkey);
+  if (!MayExist(diskDB, mkey)) return "";
 
   std::string value;
   auto status = diskDB->db->Get(rocksdb::ReadOptions(), diskDB->mt_handle,
@@ -172,7 +372,11 @@ std::string DiskSaver::GetMeta(BufPtr mkey, bool &exist) {
     return std::move(value);
   }
 
-  if (!status.IsNotFound()) LOG(ERROR) << "rocksdb Get:" << status.ToString();
+  if (!status.IsNotFound()) {
+    LOG(ERROR) << "rocksdb Get:" << status.ToString();
+  } else if (diskDB->filter != nullptr) {
+    diskDB->filter_false_positives.fetch_add(1, std::memory_order_relaxed);
+  }
   return "";
 }
 
@@ -204,61 +408,438 @@ std::vector<std::string> DiskSaver::GetValues(BufPtr mkey, BufPtrs keys,
   return std::move(values);
 }
 
-bool DiskSaver::Set(BufPtr mkey, BufPtr meta) {
-  DiskDB *diskDB = this->GetDB(mkey);
+std::vector<std::string> DiskSaver::GetMetas(const BufPtrs &mkeys,
+                                             std::vector<bool> &exists) {
+  return MultiGet(true, mkeys, mkeys, exists);
+}
+
+std::vector<std::string> DiskSaver::GetValues(const BufPtrs &mkeys,
+                                              const BufPtrs &keys,
+                                              std::vector<bool> &exists) {
+  return MultiGet(false, mkeys, keys, exists);
+}
+
+std::vector<std::string> DiskSaver::MultiGet(bool meta, const BufPtrs &mkeys,
+                                             const BufPtrs &keys,
+                                             std::vector<bool> &exists) {
+  std::vector<std::string> values(keys.size());
+  exists.assign(keys.size(), false);
+
+  std::vector<std::vector<size_t>> parts(partition_num_);
+  for (size_t i = 0; i < keys.size(); i++) {
+    parts[GetPartition(mkeys[i])].push_back(i);
+  }
+
+  std::vector<rocksdb::Slice> key_slices;
+  std::vector<rocksdb::ColumnFamilyHandle *> handles;
+  std::vector<std::string> part_values;
+  for (size_t p = 0; p < parts.size(); p++) {
+    auto &idxs = parts[p];
+    if (idxs.empty()) continue;
+
+    DiskDB *diskDB = dbs_[p];
+    if (meta && diskDB->filter != nullptr) {
+      // keys ruled out by the filter never reach rocksdb
+      size_t n = 0;
+      for (size_t i = 0; i < idxs.size(); i++) {
+        if (MayExist(diskDB, keys[idxs[i]])) idxs[n++] = idxs[i];
+      }
+      idxs.resize(n);
+      if (idxs.empty()) continue;
+    }
+
+    key_slices.clear();
+    handles.assign(idxs.size(),
+                   meta ? diskDB->mt_handle : diskDB->db_handle);
+    for (size_t i = 0; i < idxs.size(); i++) {
+      key_slices.push_back(
+          rocksdb::Slice(keys[idxs[i]]->data, keys[idxs[i]]->len));
+    }
 
-  auto status = diskDB->db->Put(rocksdb::WriteOptions(), diskDB->mt_handle,
-                                rocksdb::Slice(mkey->data, mkey->len),
-                                rocksdb::Slice(meta->data, meta->len));
+    part_values.clear();
+    auto statuss = diskDB->db->MultiGet(rocksdb::ReadOptions(), handles,
+                                        key_slices, &part_values);
+    for (size_t i = 0; i < statuss.size(); i++) {
+      if (statuss[i].ok()) {
+        exists[idxs[i]] = true;
+        values[idxs[i]] = std::move(part_values[i]);
+      } else if (!statuss[i].IsNotFound()) {
+        LOG(ERROR) << "rocksdb MuiltGet:" << statuss[i].ToString();
+      } else if (meta && diskDB->filter != nullptr) {
+        diskDB->filter_false_positives.fetch_add(1,
+                                                 std::memory_order_relaxed);
+      }
+    }
+  }
 
-  if (!status.ok()) LOG(ERROR) << "rocksdb Put:" << status.ToString();
-  return status.ok();
+  return values;
+}
+
+bool DiskSaver::Set(BufPtr mkey, BufPtr meta) {
+  DiskWriteBatch batch;
+  batch.SetMeta(mkey, meta);
+  return Write(batch);
 }
 
 bool DiskSaver::Set(BufPtr mkey, KVPairS kvs) {
-  DiskDB *diskDB = this->GetDB(mkey);
+  DiskWriteBatch batch;
+  batch.SetValues(mkey, kvs);
+  return Write(batch);
+}
+
+bool DiskSaver::Set(BufPtr mkey, BufPtr meta, KVPairS kvs) {
+  DiskWriteBatch batch;
+  batch.SetMeta(mkey, meta);
+  batch.SetValues(mkey, kvs);
+  return Write(batch);
+}
+
+bool DiskSaver::Write(DiskWriteBatch &batch) {
+  return Write(batch, false, -1);
+}
+
+bool DiskSaver::Flush() {
+  DiskWriteBatch batch;
+  batch.parts_.resize(partition_num_);
+  return Write(batch, true, -1);
+}
+
+bool DiskSaver::FlushDB(int db) {
+  DiskWriteBatch batch;
+  batch.parts_.resize(partition_num_);
+  return Write(batch, true, db);
+}
+
+bool DiskSaver::Write(DiskWriteBatch &batch, bool flush, int db) {
+  std::vector<DiskWriteReq> reqs(batch.parts_.size());
+
+  // queue every part first, so the partitions commit in parallel
+  for (size_t i = 0; i < batch.parts_.size(); i++) {
+    DiskWriteReq &req = reqs[i];
+    req.ops = &batch.parts_[i];
+    req.flush = flush;
+    req.db = db;
+    req.done = true;
+    req.ok = true;
+    if (req.ops->empty() && !flush) continue;
+
+    req.bytes = 0;
+    for (auto iter = req.ops->begin(); iter != req.ops->end(); ++iter) {
+      req.bytes += iter->key->len;
+      if (iter->value != nullptr) req.bytes += iter->value->len;
+    }
+    req.done = false;
+
+    WriteAsyncQueue *wq = write_queues_[i];
+    uv_mutex_lock(&wq->mutex);
+    QUEUE_INSERT_TAIL(&wq->queue, &req.wq);
+    wq->bytes += req.bytes;
+    uv_cond_signal(&wq->cond);
+    uv_mutex_unlock(&wq->mutex);
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < reqs.size(); i++) {
+    DiskWriteReq &req = reqs[i];
+    if (!req.done) {
+      WriteAsyncQueue *wq = write_queues_[i];
+      uv_mutex_lock(&wq->mutex);
+      while (!req.done) uv_cond_wait(&wq->done_cond, &wq->mutex);
+      uv_mutex_unlock(&wq->mutex);
+    }
+    if (!req.ok) ok = false;
+  }
+  return ok;
+}
+
+void DiskSaver::WriteLoop(size_t idx) {
+  WriteAsyncQueue *wq = write_queues_[idx];
+  size_t max_bytes = FLAGS_write_batch_max_bytes;
+  uint64_t max_delay = (uint64_t)FLAGS_write_batch_max_delay_us * 1000;
+  std::vector<DiskWriteReq *> reqs;
+
+  while (true) {
+    uv_mutex_lock(&wq->mutex);
+    while (QUEUE_EMPTY(&wq->queue)) uv_cond_wait(&wq->cond, &wq->mutex);
+
+    // give concurrent writers up to the max delay to join the batch
+    if (max_delay > 0 && wal_mode_ != Wal_Always && wq->bytes < max_bytes) {
+      uint64_t deadline = uv_hrtime() + max_delay, now;
+      while (wq->bytes < max_bytes && (now = uv_hrtime()) < deadline) {
+        uv_cond_timedwait(&wq->cond, &wq->mutex, deadline - now);
+      }
+    }
+
+    // take requests up to the max bytes, a larger one goes alone, and in
+    // Wal_Always mode every request is synced alone
+    size_t bytes = 0;
+    while (!QUEUE_EMPTY(&wq->queue)) {
+      QUEUE *q = QUEUE_HEAD(&wq->queue);
+      DiskWriteReq *req = QUEUE_DATA(q, DiskWriteReq, wq);
+      if (!reqs.empty() &&
+          (wal_mode_ == Wal_Always || bytes + req->bytes > max_bytes ||
+           req->flush || reqs[0]->flush)) {
+        break;
+      }
+
+      QUEUE_REMOVE(q);
+      bytes += req->bytes;
+      wq->bytes -= req->bytes;
+      reqs.push_back(req);
+    }
+    uv_mutex_unlock(&wq->mutex);
+
+    WriteBatch(idx, reqs);
+    reqs.clear();
+  }
+}
+
+void DiskSaver::WriteBatch(size_t idx,
+                           const std::vector<DiskWriteReq *> &reqs) {
+  DiskDB *diskDB = dbs_[idx];
+  if (reqs[0]->flush) {
+    bool ok = FlushPartition(idx, reqs[0]->db);
+    WriteDone(write_queues_[idx], reqs, ok);
+    return;
+  }
 
   rocksdb::WriteBatch batch;
-  for (auto iter = kvs.begin(); iter != kvs.end(); ++iter) {
-    auto status = batch.Put(
-        diskDB->db_handle, rocksdb::Slice(iter->first->data, iter->first->len),
-        rocksdb::Slice(iter->second->data, iter->second->len));
+  rocksdb::Status status;
+  for (size_t i = 0; i < reqs.size() && status.ok(); i++) {
+    DiskWriteOps *ops = reqs[i]->ops;
+    for (auto iter = ops->begin(); iter != ops->end(); ++iter) {
+      // a key is in the filter before its meta can be read
+      if (iter->meta && diskDB->filter != nullptr) {
+        diskDB->filter->Add(KeyHash(iter->key->data, iter->key->len));
+      }
+
+      auto handle = iter->meta ? diskDB->mt_handle : diskDB->db_handle;
+      rocksdb::Slice key(iter->key->data, iter->key->len);
+      if (iter->value == nullptr) {
+        status = batch.Delete(handle, key);
+      } else {
+        status = batch.Put(handle, key,
+                           rocksdb::Slice(iter->value->data, iter->value->len));
+      }
+      if (!status.ok()) {
+        LOG(ERROR) << "rocksdb WriteBatch:" << status.ToString();
+        break;
+      }
+    }
+  }
+
+  if (status.ok()) {
+    rocksdb::WriteOptions ops;
+    ops.sync = wal_mode_ == Wal_Always || wal_mode_ == Wal_Group;
+    ops.disableWAL = wal_mode_ == Wal_None;
+    status = diskDB->db->Write(ops, &batch);
     if (!status.ok()) {
-      LOG(ERROR) << "rocksdb WriteBatch.Put:" << status.ToString();
-      return false;
+      LOG(ERROR) << "rocksdb Write:" << status.ToString();
+    } else if (ops.sync) {
+      wal_syncs_++;
     }
   }
 
-  auto status = diskDB->db->Write(rocksdb::WriteOptions(), &batch);
-  if (!status.ok()) LOG(ERROR) << "rocksdb Write:" << status.ToString();
-  return status.ok();
+  WriteDone(write_queues_[idx], reqs, status.ok());
 }
 
-bool DiskSaver::Set(BufPtr mkey, BufPtr meta, KVPairS kvs) {
-  DiskDB *diskDB = this->GetDB(mkey);
+// a range delete of each column family, whose files are dropped at once.
+// every db is up to the last key, and the key filter starts empty. the
+// filter is shared by the dbs, so the keys of one db stay in it as false
+// positives. the writer of the partition runs it, so no write is in between
+bool DiskSaver::FlushPartition(size_t idx, int db) {
+  DiskDB *diskDB = dbs_[idx];
+  uint64_t start = GetMilliSec();
+
+  // the db keys of db are in [db, db + 1)
+  char range[2] = {(char)db, (char)(db + 1)};
+  rocksdb::Slice begin(range, 1), end(range + 1, 1);
 
   rocksdb::WriteBatch batch;
-  auto status =
-      batch.Put(diskDB->mt_handle, rocksdb::Slice(mkey->data, mkey->len),
-                rocksdb::Slice(meta->data, meta->len));
+  rocksdb::ColumnFamilyHandle *handles[] = {diskDB->mt_handle,
+                                            diskDB->db_handle};
+  for (int i = 0; i < 2; i++) {
+    if (db >= 0) {
+      batch.DeleteRange(handles[i], begin, end);
+      continue;
+    }
+
+    rocksdb::Iterator *iter =
+        diskDB->db->NewIterator(rocksdb::ReadOptions(), handles[i]);
+    iter->SeekToLast();
+    if (iter->Valid()) {
+      std::string last = iter->key().ToString();
+      batch.DeleteRange(handles[i], rocksdb::Slice(), last);
+      batch.Delete(handles[i], last);
+    }
+    delete iter;
+  }
+
+  rocksdb::WriteOptions ops;
+  ops.sync = wal_mode_ != Wal_None;
+  ops.disableWAL = wal_mode_ == Wal_None;
+  auto status = diskDB->db->Write(ops, &batch);
   if (!status.ok()) {
-    LOG(ERROR) << "rocksdb WriteBatch.Put:" << status.ToString();
+    LOG(ERROR) << "rocksdb flush " << diskDB->partition_name << ":"
+               << status.ToString();
     return false;
   }
 
-  for (auto iter = kvs.begin(); iter != kvs.end(); ++iter) {
-    auto status = batch.Put(
-        diskDB->db_handle, rocksdb::Slice(iter->first->data, iter->first->len),
-        rocksdb::Slice(iter->second->data, iter->second->len));
+  for (int i = 0; i < 2; i++) {
+    status = rocksdb::DeleteFilesInRange(diskDB->db, handles[i],
+                                         db >= 0 ? &begin : nullptr,
+                                         db >= 0 ? &end : nullptr);
+    LOG_IF(ERROR, !status.ok()) << "rocksdb DeleteFilesInRange:"
+                                << status.ToString();
+  }
+
+  if (db < 0 && diskDB->filter != nullptr) diskDB->filter->Clear();
+  LOG(INFO) << "flush " << diskDB->partition_name
+            << (db >= 0 ? Format(" db%d", db) : "") << ", "
+            << GetMilliSec() - start << "ms";
+  return true;
+}
+
+// the requests live on the stacks of their waiters, which may return as
+// soon as done is set
+void DiskSaver::WriteDone(WriteAsyncQueue *wq,
+                          const std::vector<DiskWriteReq *> &reqs, bool ok) {
+  uv_mutex_lock(&wq->mutex);
+  for (size_t i = 0; i < reqs.size(); i++) {
+    reqs[i]->ok = ok;
+    reqs[i]->done = true;
+  }
+  wq->snum++;
+  wq->rnum += reqs.size();
+  uv_cond_broadcast(&wq->done_cond);
+  uv_mutex_unlock(&wq->mutex);
+}
+
+void DiskSaver::SyncLoop() {
+  // batches committed at the last sync of each partition
+  std::vector<uint64_t> synced(partition_num_, 0);
+
+  while (true) {
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(FLAGS_wal_sync_interval_ms));
+
+    for (size_t i = 0; i < partition_num_; i++) {
+      WriteAsyncQueue *wq = write_queues_[i];
+      uv_mutex_lock(&wq->mutex);
+      uint64_t snum = wq->snum;
+      uv_mutex_unlock(&wq->mutex);
+      if (snum == synced[i]) continue;
+
+      auto status = dbs_[i]->db->SyncWAL();
+      if (!status.ok()) {
+        LOG(ERROR) << "rocksdb SyncWAL:" << status.ToString();
+        continue;
+      }
+      synced[i] = snum;
+      wal_syncs_++;
+    }
+  }
+}
+
+std::string DiskSaver::Info() {
+  uint64_t batches = 0, requests = 0;
+  for (size_t i = 0; i < write_queues_.size(); i++) {
+    WriteAsyncQueue *wq = write_queues_[i];
+    uv_mutex_lock(&wq->mutex);
+    batches += wq->snum;
+    requests += wq->rnum;
+    uv_mutex_unlock(&wq->mutex);
+  }
+
+  std::string info = "# Persistence\r\n";
+  info += Format("wal_mode:%s\r\n", WalModeName(wal_mode_));
+  if (wal_mode_ == Wal_EverySec) {
+    info += Format("wal_sync_interval_ms:%d\r\n", FLAGS_wal_sync_interval_ms);
+  }
+  info += Format("wal_syncs:%llu\r\n", (unsigned long long)wal_syncs_.load());
+  info += Format("write_batches:%llu\r\n", (unsigned long long)batches);
+  info += Format("write_requests:%llu\r\n", (unsigned long long)requests);
+  info += Format("write_batch_avg_requests:%.2f\r\n",
+                 batches > 0 ? (double)requests / batches : 0.0);
+
+  if (FLAGS_key_filter) {
+    uint64_t keys = 0, memory = 0, negatives = 0, false_positives = 0;
+    for (size_t i = 0; i < dbs_.size(); i++) {
+      keys += dbs_[i]->filter->keys();
+      memory += dbs_[i]->filter->memory();
+      negatives += dbs_[i]->filter_negatives.load();
+      false_positives += dbs_[i]->filter_false_positives.load();
+    }
+    info += Format("key_filter_keys:%llu\r\n", (unsigned long long)keys);
+    info += Format("key_filter_memory:%llu\r\n", (unsigned long long)memory);
+    info += Format("key_filter_negatives:%llu\r\n",
+                   (unsigned long long)negatives);
+    info += Format("key_filter_false_positives:%llu\r\n",
+                   (unsigned long long)false_positives);
+  }
+  return info;
+}
+
+// the estimated keys of the meta column family of a partition are split
+// among the dbs by the sizes of their ranges
+std::vector<uint64_t> DiskSaver::EstimateDBKeys() {
+  std::vector<uint64_t> counts(DB_NUM, 0);
+
+  char bounds[DB_NUM + 1];
+  rocksdb::Range ranges[DB_NUM];
+  for (int i = 0; i <= DB_NUM; i++) bounds[i] = (char)i;
+  for (int i = 0; i < DB_NUM; i++) {
+    ranges[i] = rocksdb::Range(rocksdb::Slice(bounds + i, 1),
+                               rocksdb::Slice(bounds + i + 1, 1));
+  }
+
+  rocksdb::SizeApproximationOptions ops;
+  ops.include_memtables = true;
+  uint64_t sizes[DB_NUM];
+  for (size_t i = 0; i < dbs_.size(); i++) {
+    uint64_t keys = 0;
+    dbs_[i]->db->GetIntProperty(dbs_[i]->mt_handle,
+                                rocksdb::DB::Properties::kEstimateNumKeys,
+                                &keys);
+    auto status = dbs_[i]->db->GetApproximateSizes(ops, dbs_[i]->mt_handle,
+                                                   ranges, DB_NUM, sizes);
     if (!status.ok()) {
-      LOG(ERROR) << "rocksdb WriteBatch.Put:" << status.ToString();
-      return false;
+      LOG(ERROR) << "rocksdb GetApproximateSizes:" << status.ToString();
+      continue;
+    }
+
+    uint64_t total = 0;
+    for (int j = 0; j < DB_NUM; j++) total += sizes[j];
+    if (total == 0) continue;
+    for (int j = 0; j < DB_NUM; j++) {
+      counts[j] += (uint64_t)((double)keys * sizes[j] / total);
     }
   }
+  return counts;
+}
+
+DiskWriteOps &DiskWriteBatch::GetOps(BufPtr mkey) {
+  DiskSaver *saver = DiskSaver::Default();
+  if (parts_.empty()) parts_.resize(saver->partition_num_);
+  return parts_[saver->GetPartition(mkey)];
+}
 
-  status = diskDB->db->Write(rocksdb::WriteOptions(), &batch);
-  if (!status.ok()) LOG(ERROR) << "rocksdb Write:" << status.ToString();
-  return status.ok();
+void DiskWriteBatch::SetMeta(BufPtr mkey, BufPtr meta) {
+  GetOps(mkey).push_back(DiskWriteOp{true, mkey, meta});
+}
+
+void DiskWriteBatch::SetValues(BufPtr mkey, const KVPairS &kvs) {
+  DiskWriteOps &ops = GetOps(mkey);
+  for (auto iter = kvs.begin(); iter != kvs.end(); ++iter) {
+    ops.push_back(DiskWriteOp{false, iter->first, iter->second});
+  }
+}
+
+void DiskWriteBatch::DeleteValues(BufPtr mkey, const BufPtrs &keys) {
+  DiskWriteOps &ops = GetOps(mkey);
+  for (size_t i = 0; i < keys.size(); i++) {
+    ops.push_back(DiskWriteOp{false, keys[i], nullptr});
+  }
 }
 
 void DiskSaver::Compact() {
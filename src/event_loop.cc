@@ -2,6 +2,18 @@
 #include <glog/logging.h>
 #include <stdlib.h>
 #include <iostream>
+#include <thread>
+#include "rockin_conn.h"
+
+// pending cross thread calls of a loop, a full queue makes callers wait
+#define LOOP_QUEUE_SIZE (1024 * 64)
+
+// calls run per wakeup before the loop goes back to its connections
+#define LOOP_BATCH_SIZE 1024
+
+// connection buffers are taken in chunks of this size
+#define LOOP_CHUNK_SIZE (1024 * 16)
+#define LOOP_CHUNK_POOL_MAX 1024
 
 namespace rockin {
 class SyncData {
@@ -11,7 +23,10 @@ class SyncData {
   uv_sem_t *sem;
 };
 
-EventLoop::EventLoop() : running_(false), queue_(0xF00000) {
+EventLoop::EventLoop()
+    : running_(false),
+      queue_(LOOP_QUEUE_SIZE),
+      chunk_pool_(LOOP_CHUNK_SIZE, LOOP_CHUNK_POOL_MAX) {
   uv_loop_init(&loop_);
   loop_.data = this;
 }
@@ -44,13 +59,21 @@ void EventLoop::RunLoop() {
     lt->RunInLoop();
   });
 
+  // replies of one loop iteration are written by a single writev
+  prepare_.data = this;
+  uv_prepare_init(&loop_, &prepare_);
+  uv_prepare_start(&prepare_, [](uv_prepare_t *handle) {
+    EventLoop *lt = (EventLoop *)handle->data;
+    lt->FlushConns();
+  });
+
   while (this->running_) {
     uv_run(&loop_, UV_RUN_DEFAULT);
   }
 }
 
 void EventLoop::RunInLoop() {
-  while (true) {
+  for (int i = 0; i < LOOP_BATCH_SIZE; i++) {
     SyncData *sd = queue_.Pop();
     if (sd == nullptr) {
       return;
@@ -66,6 +89,36 @@ void EventLoop::RunInLoop() {
     else
       delete sd;
   }
+
+  // more left, run them after this round of io
+  uv_async_send(&async_);
+}
+
+void EventLoop::Push(SyncData *sd) {
+  while (!queue_.Push(sd)) {
+    // the loop thread can only wait for itself by draining the queue
+    if (uv_thread_self() == thread_) {
+      RunInLoop();
+    } else {
+      uv_async_send(&async_);
+      std::this_thread::yield();
+    }
+  }
+  uv_async_send(&async_);
+}
+
+void EventLoop::AddFlushConn(std::shared_ptr<RockinConn> conn) {
+  flush_conns_.push_back(std::move(conn));
+}
+
+void EventLoop::FlushConns() {
+  if (flush_conns_.empty()) return;
+
+  flushing_conns_.swap(flush_conns_);
+  for (size_t i = 0; i < flushing_conns_.size(); i++) {
+    flushing_conns_[i]->Flush();
+  }
+  flushing_conns_.clear();
 }
 
 void EventLoop::RunInLoopNoWait(LoopCallback callback,
@@ -74,10 +127,7 @@ void EventLoop::RunInLoopNoWait(LoopCallback callback,
   sd->callback = callback;
   sd->sem = nullptr;
   sd->arg = arg;
-
-  while (!queue_.Push(sd))
-    ;
-  uv_async_send(&async_);
+  Push(sd);
 }
 
 void EventLoop::RunInLoopAndWait(LoopCallback callback,
@@ -94,10 +144,7 @@ void EventLoop::RunInLoopAndWait(LoopCallback callback,
   sd.callback = callback;
   sd.sem = &sem;
   sd.arg = arg;
-
-  while (!queue_.Push(&sd))
-    ;
-  uv_async_send(&async_);
+  Push(&sd);
   uv_sem_wait(&sem);
 }
 
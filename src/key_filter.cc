@@ -0,0 +1,100 @@
+#include "key_filter.h"
+#include "utils.h"
+
+namespace rockin {
+
+KeyFilter::KeyFilter(size_t capacity, int bits_per_key)
+    : bits_per_key_(bits_per_key), stage_num_(0), keys_(0), memory_(0) {
+  // about ln2 * bits_per_key probes give the lowest false positive rate
+  probes_ = bits_per_key * 69 / 100;
+  if (probes_ < 1) probes_ = 1;
+  if (probes_ > 30) probes_ = 30;
+
+  for (int i = 0; i < KEY_FILTER_MAX_STAGES; i++) stages_[i] = nullptr;
+  stages_[0] = NewStage(capacity);
+  stage_num_ = 1;
+}
+
+KeyFilter::~KeyFilter() {
+  for (int i = 0; i < stage_num_; i++) {
+    Stage *stage = stages_[i];
+    delete[] stage->lines;
+    delete stage;
+  }
+}
+
+KeyFilter::Stage *KeyFilter::NewStage(size_t capacity) {
+  size_t lines = NextPower(capacity * bits_per_key_ / 512 + 1);
+
+  Stage *stage = new Stage();
+  stage->lines = new Line[lines]();
+  stage->mask = lines - 1;
+  stage->capacity = capacity;
+  stage->keys = 0;
+  memory_ += lines * sizeof(Line);
+  return stage;
+}
+
+void KeyFilter::Add(uint64_t hash) {
+  int num = stage_num_.load(std::memory_order_relaxed);
+  Stage *stage = stages_[num - 1];
+  if (stage->keys >= stage->capacity && num < KEY_FILTER_MAX_STAGES) {
+    stage = NewStage(stage->capacity * 2);
+    stages_[num].store(stage, std::memory_order_relaxed);
+    stage_num_.store(num + 1, std::memory_order_release);
+  }
+
+  Line &line = stage->lines[hash & stage->mask];
+  uint32_t h = hash >> 32;
+  uint32_t delta = (h >> 17) | (h << 15);
+  for (int i = 0; i < probes_; i++) {
+    uint32_t bit = h & 511;
+    line.words[bit >> 6].fetch_or(1ULL << (bit & 63),
+                                  std::memory_order_release);
+    h += delta;
+  }
+
+  stage->keys++;
+  keys_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool KeyFilter::MayContain(uint64_t hash) {
+  int num = stage_num_.load(std::memory_order_acquire);
+  uint32_t h0 = hash >> 32;
+  uint32_t delta = (h0 >> 17) | (h0 << 15);
+
+  // the latest stage holds the most keys
+  for (int i = num - 1; i >= 0; i--) {
+    Stage *stage = stages_[i].load(std::memory_order_relaxed);
+    Line &line = stage->lines[hash & stage->mask];
+    uint32_t h = h0;
+    bool found = true;
+    for (int j = 0; j < probes_; j++) {
+      uint32_t bit = h & 511;
+      if ((line.words[bit >> 6].load(std::memory_order_acquire) &
+           (1ULL << (bit & 63))) == 0) {
+        found = false;
+        break;
+      }
+      h += delta;
+    }
+    if (found) return true;
+  }
+  return false;
+}
+
+void KeyFilter::Clear() {
+  int num = stage_num_.load(std::memory_order_relaxed);
+  for (int i = 0; i < num; i++) {
+    Stage *stage = stages_[i].load(std::memory_order_relaxed);
+    for (size_t j = 0; j <= stage->mask; j++) {
+      for (int k = 0; k < 8; k++) {
+        stage->lines[j].words[k].store(0, std::memory_order_relaxed);
+      }
+    }
+    stage->keys = 0;
+  }
+  keys_.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace rockin
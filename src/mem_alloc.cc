@@ -1,21 +1,278 @@
 #include "mem_alloc.h"
+#include <uv.h>
+#include <algorithm>
 #include <atomic>
 #include <mutex>
+#include "utils.h"
+
+// size classes of the slabs, two for each power of two: 64, 96, 128, 192
+// ... 3072, 4096 bytes. larger blocks are malloc'ed
+#define SLAB_MIN_SIZE 64
+#define SLAB_MAX_SIZE 4096
+#define SLAB_CLASSES 13
+#define SLAB_CLASS_NONE 0xFF
+
+// memory is taken from the system a page at a time and carved into blocks
+// of one class, pages are never given back
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+// bytes of free blocks a thread keeps for each class, and moves from or to
+// the central lists at a time
+#define SLAB_CACHE_BYTES (128 * 1024)
+#define SLAB_BATCH_BYTES (16 * 1024)
 
 namespace rockin {
 namespace {
+// the memory counters of a thread, written by it only and summed by the
+// readers, so no cache line is shared by the writers
+struct alignas(64) MemShard {
+  std::atomic<int64_t> sizes[Mem_Categories];
+};
+
+// shards of the live threads, and the sizes left by the exited ones. the
+// list is made on first use, buffers may be made by static initializers
 std::once_flag mem_alloc_once_flag;
-std::atomic<uint64_t> g_mem_size;
+uv_mutex_t g_shard_mutex;
+std::vector<MemShard *> *g_shards;
+std::atomic<int64_t> g_retired_sizes[Mem_Categories];
+
+// bytes of the pages carved by the slabs
+std::atomic<uint64_t> g_slab_pages;
+
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+struct FreeList {
+  FreeBlock *head;
+  size_t count;
+};
+
+// free blocks of every class shared by the threads
+std::once_flag slab_once_flag;
+uv_mutex_t g_slab_mutex[SLAB_CLASSES];
+FreeList g_slab_lists[SLAB_CLASSES];
+
+// free blocks and memory counters of one thread, used without locks. a
+// block freed by another thread than its allocator joins the cache of the
+// freeing one
+struct ThreadCache {
+  FreeList lists[SLAB_CLASSES];
+  MemShard *shard;
+  ~ThreadCache();
+};
+
+thread_local ThreadCache t_cache;
+
+// the cache is gone, blocks freed later in the exiting thread go to the
+// central lists and sizes to the retired counters
+thread_local bool t_cache_done = false;
 };  // namespace
 
-void change_momory_size(size_t size) {
-  std::call_once(mem_alloc_once_flag, []() { g_mem_size = 0; });
-  g_mem_size.fetch_add(size);
+static void MemInit() {
+  std::call_once(mem_alloc_once_flag, []() {
+    uv_mutex_init(&g_shard_mutex);
+    g_shards = new std::vector<MemShard *>();
+  });
+}
+
+static MemShard *NewShard() {
+  MemInit();
+  MemShard *shard = new MemShard();
+  for (int i = 0; i < Mem_Categories; i++) shard->sizes[i] = 0;
+
+  uv_mutex_lock(&g_shard_mutex);
+  g_shards->push_back(shard);
+  uv_mutex_unlock(&g_shard_mutex);
+  return shard;
+}
+
+// the sizes of an exiting thread are kept by the retired counters
+static void RetireShard(MemShard *shard) {
+  uv_mutex_lock(&g_shard_mutex);
+  for (int i = 0; i < Mem_Categories; i++) {
+    g_retired_sizes[i].fetch_add(shard->sizes[i].load());
+  }
+  g_shards->erase(std::find(g_shards->begin(), g_shards->end(), shard));
+  uv_mutex_unlock(&g_shard_mutex);
+  delete shard;
+}
+
+void change_momory_size(MemCategory category, int64_t size) {
+  if (t_cache_done) {
+    MemInit();
+    g_retired_sizes[category].fetch_add(size, std::memory_order_relaxed);
+    return;
+  }
+
+  if (t_cache.shard == nullptr) t_cache.shard = NewShard();
+  std::atomic<int64_t> &counter = t_cache.shard->sizes[category];
+  counter.store(counter.load(std::memory_order_relaxed) + size,
+                std::memory_order_relaxed);
+}
+
+int64_t get_memory_size(MemCategory category) {
+  MemInit();
+  uv_mutex_lock(&g_shard_mutex);
+  int64_t size = g_retired_sizes[category].load();
+  for (size_t i = 0; i < g_shards->size(); i++) {
+    size += (*g_shards)[i]->sizes[category].load(std::memory_order_relaxed);
+  }
+  uv_mutex_unlock(&g_shard_mutex);
+  return size;
 }
 
 uint64_t get_memory_size() {
-  std::call_once(mem_alloc_once_flag, []() { g_mem_size = 0; });
-  return g_mem_size.load();
+  int64_t size = 0;
+  for (int i = 0; i < Mem_Categories; i++) {
+    size += get_memory_size((MemCategory)i);
+  }
+  return size > 0 ? size : 0;
+}
+
+std::string memory_info() {
+  static const char *names[Mem_Categories] = {"other", "args", "replies",
+                                              "objects", "disk"};
+  int64_t sizes[Mem_Categories], total = 0;
+  for (int i = 0; i < Mem_Categories; i++) {
+    sizes[i] = get_memory_size((MemCategory)i);
+    total += sizes[i];
+  }
+
+  std::string info = "# Memory\r\n";
+  info += Format("used_memory:%lld\r\n", (long long)total);
+  for (int i = 0; i < Mem_Categories; i++) {
+    info += Format("used_memory_%s:%lld\r\n", names[i], (long long)sizes[i]);
+  }
+  info += Format("slab_pages_memory:%llu\r\n",
+                 (unsigned long long)g_slab_pages.load());
+  return info;
+}
+
+static inline int SlabClass(size_t size) {
+  if (size <= SLAB_MIN_SIZE) return 0;
+  if (size > SLAB_MAX_SIZE) return SLAB_CLASS_NONE;
+
+  // size is in (2^k, 2^(k+1)], whose classes are 1.5 * 2^k and 2^(k+1)
+  int k = 63 - __builtin_clzll(size - 1);
+  size_t pow = 1ULL << k;
+  return (k - 6) * 2 + (size > pow + pow / 2 ? 2 : 1);
+}
+
+static inline size_t SlabClassSize(int cls) {
+  return (cls % 2 == 0 ? 64 : 96) << (cls / 2);
+}
+
+static void SlabInit() {
+  std::call_once(slab_once_flag, []() {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+      uv_mutex_init(&g_slab_mutex[i]);
+      g_slab_lists[i].head = nullptr;
+      g_slab_lists[i].count = 0;
+    }
+  });
+}
+
+// move up to n free blocks of cls from the central list to list, a new
+// page is carved when the central list is empty
+static void SlabFetch(int cls, FreeList &list, size_t n) {
+  SlabInit();
+  size_t size = SlabClassSize(cls);
+  FreeList &central = g_slab_lists[cls];
+
+  uv_mutex_lock(&g_slab_mutex[cls]);
+  if (central.head == nullptr) {
+    char *page = (char *)malloc(SLAB_PAGE_SIZE);
+    for (size_t off = 0; off + size <= SLAB_PAGE_SIZE; off += size) {
+      FreeBlock *block = (FreeBlock *)(page + off);
+      block->next = central.head;
+      central.head = block;
+      central.count++;
+    }
+    g_slab_pages.fetch_add(SLAB_PAGE_SIZE);
+  }
+
+  while (n-- > 0 && central.head != nullptr) {
+    FreeBlock *block = central.head;
+    central.head = block->next;
+    central.count--;
+    block->next = list.head;
+    list.head = block;
+    list.count++;
+  }
+  uv_mutex_unlock(&g_slab_mutex[cls]);
+}
+
+// move free blocks of cls from list to the central list until list keeps
+// at most n
+static void SlabRelease(int cls, FreeList &list, size_t n) {
+  SlabInit();
+  FreeList &central = g_slab_lists[cls];
+
+  uv_mutex_lock(&g_slab_mutex[cls]);
+  while (list.count > n) {
+    FreeBlock *block = list.head;
+    list.head = block->next;
+    list.count--;
+    block->next = central.head;
+    central.head = block;
+    central.count++;
+  }
+  uv_mutex_unlock(&g_slab_mutex[cls]);
+}
+
+ThreadCache::~ThreadCache() {
+  for (int i = 0; i < SLAB_CLASSES; i++) SlabRelease(i, lists[i], 0);
+  if (shard != nullptr) RetireShard(shard);
+  t_cache_done = true;
+}
+
+void *slab_alloc(size_t size, uint8_t &cls) {
+  int c = SlabClass(size);
+  if (c == SLAB_CLASS_NONE) {
+    cls = SLAB_CLASS_NONE;
+    return malloc(size);
+  }
+
+  cls = c;
+  if (t_cache_done) {
+    FreeList one = {nullptr, 0};
+    SlabFetch(c, one, 1);
+    return one.head;
+  }
+
+  FreeList &list = t_cache.lists[c];
+  if (list.head == nullptr) {
+    SlabFetch(c, list, SLAB_BATCH_BYTES / SlabClassSize(c));
+  }
+
+  FreeBlock *block = list.head;
+  list.head = block->next;
+  list.count--;
+  return block;
+}
+
+void slab_free(void *ptr, uint8_t cls) {
+  if (cls == SLAB_CLASS_NONE) {
+    free(ptr);
+    return;
+  }
+
+  FreeBlock *block = (FreeBlock *)ptr;
+  if (t_cache_done) {
+    FreeList one = {block, 1};
+    block->next = nullptr;
+    SlabRelease(cls, one, 0);
+    return;
+  }
+
+  FreeList &list = t_cache.lists[cls];
+  block->next = list.head;
+  list.head = block;
+  list.count++;
+
+  size_t limit = SLAB_CACHE_BYTES / SlabClassSize(cls);
+  if (list.count > limit) SlabRelease(cls, list, limit / 2);
 }
 
-}  // namespace rockin
\ No newline at end of file
+}  // namespace rockin
@@ -1,11 +1,23 @@
 #include "mem_saver.h"
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdlib.h>
+#include <atomic>
 #include <mutex>
-#include "dic_table.h"
+#include "cmd_interface.h"
+#include "frequency_sketch.h"
 #include "siphash.h"
+#include "swiss_table.h"
+#include "timer_wheel.h"
 #include "utils.h"
 
+DEFINE_int64(cache_max_memory, 1LL << 30,
+             "max bytes of objects cached in memory, split evenly by the "
+             "workers");
+DEFINE_int32(cache_window_percent, 1,
+             "percent of the cache memory for new objects, they leave it "
+             "for the main cache only if seen more often than its victims");
+
 namespace rockin {
 namespace {
 std::once_flag once_flag;
@@ -17,74 +29,417 @@ MemSaver *MemSaver::Default() {
   return g_data;
 }
 
-static uint64_t obj_key_hash(std::shared_ptr<object_t> obj) {
-  return rockin::Hash((const uint8_t *)obj->key->data, obj->key->len);
+// a cached object and its place in the window or the main lru list, it is
+// charged by the size of obj, which never changes
+struct CacheEntry {
+  uint64_t hash;
+  ObjPtr obj;
+  CacheEntry *prev;
+  CacheEntry *next;
+  bool window;
+};
+
+// a lookup of key, its hash is computed once
+struct EntryKey {
+  const char *data;
+  size_t len;
+  uint64_t hash;
+};
+
+struct EntryHash {
+  uint64_t operator()(const CacheEntry *entry) const { return entry->hash; }
+  uint64_t operator()(const EntryKey &key) const { return key.hash; }
+};
+
+struct EntryEqual {
+  static bool Equal(object_t *obj, const char *data, size_t len) {
+    return obj->key_len == len && memcmp(obj->key_data(), data, len) == 0;
+  }
+  bool operator()(const CacheEntry *a, const CacheEntry *b) const {
+    return Equal(a->obj.get(), b->obj->key_data(), b->obj->key_len);
+  }
+  bool operator()(const CacheEntry *a, const EntryKey &key) const {
+    return Equal(a->obj.get(), key.data, key.len);
+  }
+};
+
+typedef SwissTable<CacheEntry *, EntryHash, EntryEqual> EntryTable;
+
+// memory held by a cached object
+static size_t ObjCharge(const ObjPtr &obj) {
+  size_t charge = sizeof(CacheEntry *) + 1 + sizeof(CacheEntry) + obj->Size();
+  if (obj->value != nullptr) charge += sizeof(buffer_t) + obj->value->len;
+  return charge;
+}
+
+// stats are written by the owner worker only and read by INFO
+static inline void StatAdd(std::atomic<uint64_t> &stat, int64_t n) {
+  stat.store(stat.load(std::memory_order_relaxed) + n,
+             std::memory_order_relaxed);
 }
 
-static bool obj_key_equal(std::shared_ptr<object_t> a,
-                          std::shared_ptr<object_t> b) {
-  if ((a == nullptr || a->key == nullptr) &&
-      (b == nullptr || b->key == nullptr))
-    return true;
+// entries in recency order, head is the most recent
+struct LruList {
+  CacheEntry *head;
+  CacheEntry *tail;
+  size_t memory;
+
+  LruList() : head(nullptr), tail(nullptr), memory(0) {}
+
+  void PushFront(CacheEntry *entry) {
+    entry->prev = nullptr;
+    entry->next = head;
+    if (head != nullptr) head->prev = entry;
+    head = entry;
+    if (tail == nullptr) tail = entry;
+    memory += ObjCharge(entry->obj);
+  }
+
+  void Unlink(CacheEntry *entry) {
+    if (entry->prev != nullptr)
+      entry->prev->next = entry->next;
+    else
+      head = entry->next;
+
+    if (entry->next != nullptr)
+      entry->next->prev = entry->prev;
+    else
+      tail = entry->prev;
+    memory -= ObjCharge(entry->obj);
+  }
+
+  void Touch(CacheEntry *entry) {
+    if (head == entry) return;
+    Unlink(entry);
+    PushFront(entry);
+  }
+};
+
+// the cache of one worker, a W-TinyLFU: new objects enter a small lru
+// window, and an object leaving the window only displaces the least
+// recent objects of the main lru when the frequency sketch says it is
+// more popular, so a scan of one-hit keys can not flush the hot ones
+class MemCache {
+ public:
+  MemCache(size_t max_memory)
+      : max_memory_(max_memory),
+        used_memory_(0),
+        keys_(0),
+        hits_(0),
+        misses_(0),
+        evictions_(0),
+        rejects_(0),
+        expire_keys_(0),
+        expired_(0) {
+    window_max_ = max_memory * FLAGS_cache_window_percent / 100;
+    main_max_ = max_memory - window_max_;
+  }
 
-  if (a == nullptr || a->key == nullptr || b == nullptr || b->key == nullptr)
-    return false;
+  ObjPtr Get(BufPtr key) {
+    uint64_t hash = 0;
+    CacheEntry *entry = Find(key->data, key->len, hash);
+    sketch_.Increment(hash);
 
-  if (a->key->len != b->key->len) return false;
-  for (size_t i = 0; i < a->key->len; i++) {
-    if (*((char *)(a->key->data) + i) != *((char *)(b->key->data) + i)) {
-      return false;
+    if (entry != nullptr && entry->obj->expire > 0 &&
+        GetMilliSec() >= entry->obj->expire) {
+      Remove(entry);
+      entry = nullptr;
     }
+
+    if (entry == nullptr) {
+      StatAdd(misses_, 1);
+      return nullptr;
+    }
+
+    StatAdd(hits_, 1);
+    List(entry).Touch(entry);
+    return entry->obj;
   }
-  return true;
-}
 
-static int obj_key_compare(std::shared_ptr<object_t> a,
-                           std::shared_ptr<object_t> b) {
-  if ((a == nullptr || a->key == nullptr) &&
-      (b == nullptr || b->key == nullptr))
-    return 0;
-  if (a == nullptr || a->key == nullptr) return -1;
-  if (b == nullptr || b->key == nullptr) return 1;
+  void Insert(ObjPtr obj) {
+    uint64_t hash = 0;
+    CacheEntry *entry = Find(obj->key_data(), obj->key_len, hash);
+    if (entry != nullptr) {
+      LruList &list = List(entry);
+      list.Unlink(entry);
+      StatAdd(used_memory_, -(int64_t)ObjCharge(entry->obj));
+      entry->obj = obj;
+      list.PushFront(entry);
+    } else {
+      entry = new CacheEntry();
+      entry->hash = hash;
+      entry->obj = obj;
+      entry->window = true;
+      window_.PushFront(entry);
 
-  for (size_t i = 0; i < a->key->len && i < b->key->len; i++) {
-    uint8_t ac = *((uint8_t *)(a->key->data) + i);
-    uint8_t bc = *((uint8_t *)(b->key->data) + i);
-    if (ac > bc) return 1;
-    if (ac < bc) return -1;
+      table_.Insert(entry);
+      StatAdd(keys_, 1);
+      sketch_.EnsureCapacity(keys_.load(std::memory_order_relaxed));
+    }
+
+    StatAdd(used_memory_, ObjCharge(obj));
+    Evict();
   }
 
-  if (a->key->len > b->key->len) return 1;
-  if (a->key->len < b->key->len) return -1;
-  return 0;
-}
+  void Delete(BufPtr key) {
+    uint64_t hash = 0;
+    CacheEntry *entry = Find(key->data, key->len, hash);
+    if (entry != nullptr) Remove(entry);
+  }
+
+  void Clear() {
+    LruList *lists[] = {&window_, &main_};
+    for (LruList *list : lists) {
+      CacheEntry *entry = list->head;
+      while (entry != nullptr) {
+        CacheEntry *next = entry->next;
+        delete entry;
+        entry = next;
+      }
+      *list = LruList();
+    }
+    table_.Clear();
+    wheel_.Clear();
 
-MemSaver::MemSaver() { uv_key_create(&key_); }
+    used_memory_.store(0, std::memory_order_relaxed);
+    keys_.store(0, std::memory_order_relaxed);
+    expire_keys_.store(0, std::memory_order_relaxed);
+  }
 
-MemSaver::~MemSaver() {}
+  // the keys of db left in the wheel are skipped by the active expire
+  void ClearDB(int db) {
+    LruList *lists[] = {&window_, &main_};
+    for (LruList *list : lists) {
+      CacheEntry *entry = list->head;
+      while (entry != nullptr) {
+        CacheEntry *next = entry->next;
+        if (DB_KEY_INDEX(entry->obj->key_data()) == db) Remove(entry);
+        entry = next;
+      }
+    }
+  }
+
+  void SetExpire(BufPtr key, uint64_t expire_ms) {
+    uint64_t hash = 0;
+    CacheEntry *entry = Find(key->data, key->len, hash);
+    if (entry != nullptr) entry->obj->expire = expire_ms;
+
+    if (expire_ms > 0) {
+      wheel_.Add(key->data, key->len, expire_ms);
+      expire_keys_.store(wheel_.Size(), std::memory_order_relaxed);
+    }
+  }
+
+  BufPtrs GetExpired(uint64_t now, size_t max) {
+    BufPtrs keys;
+    StatAdd(expired_, wheel_.Expire(now, max, keys));
+    expire_keys_.store(wheel_.Size(), std::memory_order_relaxed);
+    return keys;
+  }
+
+  uint64_t max_memory() { return max_memory_; }
+  uint64_t used_memory() { return used_memory_.load(); }
+  uint64_t keys() { return keys_.load(); }
+  uint64_t hits() { return hits_.load(); }
+  uint64_t misses() { return misses_.load(); }
+  uint64_t evictions() { return evictions_.load(); }
+  uint64_t rejects() { return rejects_.load(); }
+  uint64_t expire_keys() { return expire_keys_.load(); }
+  uint64_t expired() { return expired_.load(); }
+
+ private:
+  CacheEntry *Find(const char *data, size_t len, uint64_t &hash) {
+    hash = rockin::Hash((const uint8_t *)data, len);
+    CacheEntry **slot = table_.Find(EntryKey{data, len, hash});
+    return slot == nullptr ? nullptr : *slot;
+  }
+
+  LruList &List(CacheEntry *entry) { return entry->window ? window_ : main_; }
+
+  void Remove(CacheEntry *entry) {
+    List(entry).Unlink(entry);
+    StatAdd(used_memory_, -(int64_t)ObjCharge(entry->obj));
+    StatAdd(keys_, -1);
 
-bool MemSaver::Init() {
-  void *arg = uv_key_get(&key_);
-  if (arg == nullptr) {
-    arg = new DicTable<object_t>(obj_key_equal, obj_key_hash);
+    table_.Erase(
+        EntryKey{entry->obj->key_data(), entry->obj->key_len, entry->hash});
+    delete entry;
   }
+
+  void Evict() {
+    // the lru of the window is a candidate for main, it displaces main's
+    // lru victims only while it is seen more often than each of them. the
+    // newest object always stays in the window
+    while (window_.memory > window_max_ && window_.tail != window_.head) {
+      CacheEntry *candidate = window_.tail;
+      window_.Unlink(candidate);
+      candidate->window = false;
+      main_.PushFront(candidate);
+
+      int freq = sketch_.Frequency(candidate->hash);
+      while (main_.memory > main_max_) {
+        CacheEntry *victim = main_.tail;
+        if (victim != candidate && sketch_.Frequency(victim->hash) < freq) {
+          Remove(victim);
+          StatAdd(evictions_, 1);
+        } else {
+          Remove(candidate);
+          StatAdd(rejects_, 1);
+          break;
+        }
+      }
+    }
+
+    // main outgrown by updates of its objects
+    while (main_.memory > main_max_ && main_.tail != nullptr) {
+      Remove(main_.tail);
+      StatAdd(evictions_, 1);
+    }
+  }
+
+ private:
+  EntryTable table_;
+  FrequencySketch sketch_;
+  LruList window_, main_;
+  TimerWheel wheel_;
+  size_t window_max_, main_max_;
+  uint64_t max_memory_;
+  std::atomic<uint64_t> used_memory_;
+  std::atomic<uint64_t> keys_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> evictions_;
+  std::atomic<uint64_t> rejects_;
+  std::atomic<uint64_t> expire_keys_;
+  std::atomic<uint64_t> expired_;
+};
+
+MemSaver::MemSaver() {
+  uv_key_create(&key_);
+  uv_mutex_init(&mutex_);
+}
+
+MemSaver::~MemSaver() {}
+
+bool MemSaver::Init(int idx, size_t worker_num) {
+  if (GetCache() != nullptr) return true;
+
+  auto cache = new MemCache(FLAGS_cache_max_memory / worker_num);
+  uv_key_set(&key_, cache);
+
+  uv_mutex_lock(&mutex_);
+  if (caches_.size() <= (size_t)idx) caches_.resize(idx + 1, nullptr);
+  caches_[idx] = cache;
+  uv_mutex_unlock(&mutex_);
   return true;
 }
 
+// the cache of the calling worker, threads other than workers have none
+MemCache *MemSaver::GetCache() { return (MemCache *)uv_key_get(&key_); }
+
 // get obj from memsaver
-ObjPtr MemSaver::GetObj(BufPtr key) { return nullptr; }
+ObjPtr MemSaver::GetObj(BufPtr key) {
+  MemCache *cache = GetCache();
+  if (cache == nullptr) return nullptr;
+  return cache->Get(key);
+}
 
 // get objs from memsaver
-ObjPtrs MemSaver::GetObj(BufPtrs keys) { return ObjPtrs(); }
+ObjPtrs MemSaver::GetObj(BufPtrs keys) {
+  ObjPtrs objs(keys.size());
+  MemCache *cache = GetCache();
+  if (cache == nullptr) return objs;
+
+  for (size_t i = 0; i < keys.size(); i++) objs[i] = cache->Get(keys[i]);
+  return objs;
+}
 
 // insert obj to memsaver
-void MemSaver::InsertObj(ObjPtr obj) {}
+void MemSaver::InsertObj(ObjPtr obj) {
+  MemCache *cache = GetCache();
+  if (cache != nullptr) cache->Insert(obj);
+}
 
 // insert obj to memsaver
-void MemSaver::InsertObj(ObjPtrs obj) {
-  //
+void MemSaver::InsertObj(ObjPtrs objs) {
+  MemCache *cache = GetCache();
+  if (cache == nullptr) return;
+
+  for (size_t i = 0; i < objs.size(); i++) {
+    if (objs[i] != nullptr) cache->Insert(objs[i]);
+  }
+}
+
+void MemSaver::UpdateExpire(BufPtr key, uint64_t expire_ms) {
+  MemCache *cache = GetCache();
+  if (cache != nullptr) cache->SetExpire(key, expire_ms);
+}
+
+BufPtrs MemSaver::GetExpiredKeys(uint64_t now, size_t max) {
+  MemCache *cache = GetCache();
+  if (cache == nullptr) return BufPtrs();
+  return cache->GetExpired(now, max);
 }
 
-void MemSaver::UpdateExpire(ObjPtr obj, uint64_t expire_ms) {}
+void MemSaver::DeleteObj(BufPtr key) {
+  MemCache *cache = GetCache();
+  if (cache != nullptr) cache->Delete(key);
+}
+
+void MemSaver::Clear() {
+  MemCache *cache = GetCache();
+  if (cache != nullptr) cache->Clear();
+}
+
+void MemSaver::ClearDB(int db) {
+  MemCache *cache = GetCache();
+  if (cache != nullptr) cache->ClearDB(db);
+}
+
+std::string MemSaver::Info() {
+  uint64_t max_memory = 0, used_memory = 0, keys = 0;
+  uint64_t hits = 0, misses = 0, evictions = 0, rejects = 0;
+  uint64_t expire_keys = 0, expired = 0;
+  std::string workers;
+  uv_mutex_lock(&mutex_);
+  for (size_t i = 0; i < caches_.size(); i++) {
+    MemCache *cache = caches_[i];
+    if (cache == nullptr) continue;
+
+    uint64_t h = cache->hits(), m = cache->misses();
+    max_memory += cache->max_memory();
+    used_memory += cache->used_memory();
+    keys += cache->keys();
+    hits += h;
+    misses += m;
+    evictions += cache->evictions();
+    rejects += cache->rejects();
+    expire_keys += cache->expire_keys();
+    expired += cache->expired();
+    workers += Format("cache_worker%d:keys=%llu,hits=%llu,misses=%llu,"
+                      "hit_rate=%.4f\r\n",
+                      (int)i, (unsigned long long)cache->keys(),
+                      (unsigned long long)h, (unsigned long long)m,
+                      h + m > 0 ? (double)h / (h + m) : 0.0);
+  }
+  uv_mutex_unlock(&mutex_);
+
+  std::string info = "# Cache\r\n";
+  info += Format("cache_max_memory:%llu\r\n", (unsigned long long)max_memory);
+  info += Format("cache_used_memory:%llu\r\n", (unsigned long long)used_memory);
+  info += Format("cache_keys:%llu\r\n", (unsigned long long)keys);
+  info += Format("cache_hits:%llu\r\n", (unsigned long long)hits);
+  info += Format("cache_misses:%llu\r\n", (unsigned long long)misses);
+  info += Format("cache_evictions:%llu\r\n", (unsigned long long)evictions);
+  info += Format("cache_admission_rejects:%llu\r\n",
+                 (unsigned long long)rejects);
+  info += Format("cache_hit_rate:%.4f\r\n",
+                 hits + misses > 0 ? (double)hits / (hits + misses) : 0.0);
+  info += Format("expire_pending_keys:%llu\r\n",
+                 (unsigned long long)expire_keys);
+  info += Format("expire_due_keys:%llu\r\n", (unsigned long long)expired);
+  info += workers;
+  return info;
+}
 
 }  // namespace rockin
@@ -1,9 +1,12 @@
 #include "rockin_conn.h"
 #include <glog/logging.h>
 #include "cmd_args.h"
+#include "cmd_reply.h"
 #include "event_loop.h"
 #include "workers.h"
 
+#define CONN_WRITE_REF_SIZE 16384
+
 namespace rockin {
 class _ConnData {
  public:
@@ -13,7 +16,16 @@ class _ConnData {
 
 RockinConn::RockinConn(
     uv_tcp_t *t, std::function<void(std::shared_ptr<RockinConn>)> close_cb)
-    : index_(0), t_(t), buf_(4096) {
+    : index_(0),
+      t_(t),
+      buf_(((EventLoop *)t->loop->data)->chunk_pool(), Mem_Args),
+      cur_seq_(0),
+      reply_seq_(0),
+      close_after_(false),
+      wbuf_(((EventLoop *)t->loop->data)->chunk_pool(), Mem_Replies),
+      flush_buf_(((EventLoop *)t->loop->data)->chunk_pool(), Mem_Replies),
+      writing_(false),
+      flush_pending_(false) {
   _ConnData *cd = new _ConnData;
   cd->close_cb = close_cb;
   t->data = cd;
@@ -109,10 +121,12 @@ void RockinConn::Close() {
   el->RunInLoopNoWait(
       [weak_conn](EventLoop *et, std::shared_ptr<void> arg) {
         auto conn = weak_conn.lock();
-        if (conn == nullptr) {
+        if (conn == nullptr || conn->t_ == nullptr ||
+            uv_is_closing((uv_handle_t *)conn->t_)) {
           return;
         }
 
+        conn->Flush();
         uv_close((uv_handle_t *)conn->handle(), [](uv_handle_t *handle) {
           // LOG(INFO) << "conncection close.";
           _ConnData *cd = (_ConnData *)handle->data;
@@ -132,38 +146,158 @@ void RockinConn::Close() {
       nullptr);
 }
 
-struct WriteHelper {
-  const std::vector<BufPtr> datas;
-  uv_buf_t *bufs;
+uint64_t RockinConn::BeginReply() {
+  cur_seq_ = reply_seq_ + replies_.size();
+  replies_.emplace_back();
+  replies_.back().holds = 1;
+  return cur_seq_;
+}
+
+void RockinConn::HoldReply(uint64_t seq) {
+  if (seq < reply_seq_ || seq - reply_seq_ >= replies_.size()) return;
+  replies_[seq - reply_seq_].holds++;
+}
 
-  WriteHelper(const std::vector<BufPtr> &&d) : datas(d) {
-    bufs = (uv_buf_t *)malloc(sizeof(uv_buf_t) * datas.size());
-    for (int i = 0; i < datas.size(); ++i)
-      *(bufs + i) = uv_buf_init(datas[i]->data, datas[i]->len);
+void RockinConn::ReleaseReply(uint64_t seq) {
+  if (seq < reply_seq_ || seq - reply_seq_ >= replies_.size()) return;
+  replies_[seq - reply_seq_].holds--;
+
+  while (!replies_.empty() && replies_.front().holds == 0) {
+    replies_.pop_front();
+    reply_seq_++;
+
+    // the next reply is at the head now, what it has waits no longer
+    if (!replies_.empty() && !replies_.front().datas.empty()) {
+      AppendOutput(replies_.front().datas);
+      replies_.front().datas.clear();
+    }
   }
 
-  ~WriteHelper() { free(bufs); }
-};
+  CloseIfDone();
+}
 
-bool RockinConn::WriteData(std::vector<BufPtr> &&datas) {
+bool RockinConn::WriteData(uint64_t seq, std::vector<BufPtr> &&datas) {
   if (t_ == nullptr) {
     return false;
   }
 
-  WriteHelper *helper = new WriteHelper(std::move(datas));
-  uv_write_t *req = (uv_write_t *)malloc(sizeof(uv_write_t));
-  req->data = helper;
+  if (seq == reply_seq_) {
+    AppendOutput(datas);
+    return true;
+  }
 
-  uv_write(req, (uv_stream_t *)t_, helper->bufs, helper->datas.size(),
-           [](uv_write_t *req, int status) {
-             WriteHelper *helper = (WriteHelper *)req->data;
-             delete helper;
-             free(req);
-           });
+  if (seq < reply_seq_ || seq - reply_seq_ >= replies_.size()) {
+    return false;
+  }
 
+  auto &pending = replies_[seq - reply_seq_].datas;
+  for (size_t i = 0; i < datas.size(); i++) {
+    pending.push_back(std::move(datas[i]));
+  }
   return true;
 }
 
+void RockinConn::AppendOutput(std::vector<BufPtr> &datas) {
+  if (t_ == nullptr) {
+    return;
+  }
+
+  for (size_t i = 0; i < datas.size(); i++) {
+    if (datas[i]->len >= CONN_WRITE_REF_SIZE) {
+      wrefs_.push_back(WriteRef{wbuf_.readable(), std::move(datas[i])});
+    } else {
+      wbuf_.append(datas[i]->data, datas[i]->len);
+    }
+  }
+
+  if (!flush_pending_) {
+    flush_pending_ = true;
+    EventLoop *el = (EventLoop *)t_->loop->data;
+    el->AddFlushConn(shared_from_this());
+  }
+}
+
+void RockinConn::CloseAfterReplies() {
+  if (close_after_) return;
+  close_after_ = true;
+
+  if (t_ != nullptr) uv_read_stop((uv_stream_t *)t_);
+  CloseIfDone();
+}
+
+void RockinConn::CloseIfDone() {
+  if (!close_after_ || !replies_.empty() || writing_) return;
+
+  // the output left is flushed first, OnWrite checks again
+  if (wbuf_.readable() > 0 || !wrefs_.empty()) return;
+  Close();
+}
+
+void RockinConn::Flush() {
+  flush_pending_ = false;
+  if (t_ == nullptr || writing_ || uv_is_closing((uv_handle_t *)t_)) {
+    return;
+  }
+
+  if (wbuf_.readable() == 0 && wrefs_.empty()) {
+    return;
+  }
+
+  flush_buf_.swap(wbuf_);
+  flush_refs_.swap(wrefs_);
+
+  size_t offset = 0;
+  iovs_.clear();
+  for (size_t i = 0; i < flush_refs_.size(); i++) {
+    WriteRef &ref = flush_refs_[i];
+    if (ref.offset > offset) {
+      iovs_.push_back(uv_buf_init(flush_buf_.readptr() + offset,
+                                  ref.offset - offset));
+      offset = ref.offset;
+    }
+    iovs_.push_back(uv_buf_init(ref.data->data, ref.data->len));
+  }
+  if (flush_buf_.readable() > offset) {
+    iovs_.push_back(uv_buf_init(flush_buf_.readptr() + offset,
+                                flush_buf_.readable() - offset));
+  }
+
+  write_req_.data = this;
+  int ret = uv_write(&write_req_, (uv_stream_t *)t_, iovs_.data(),
+                     iovs_.size(), RockinConn::OnWrite);
+  if (ret != 0) {
+    LOG(ERROR) << "uv_write error:" << GetUvError(ret);
+    flush_buf_.clear();
+    flush_buf_.shrink();
+    flush_refs_.clear();
+    CloseIfDone();
+    return;
+  }
+
+  writing_ = true;
+  write_self_ = shared_from_this();
+}
+
+void RockinConn::OnWrite(uv_write_t *req, int status) {
+  RockinConn *conn = (RockinConn *)req->data;
+  auto self = std::move(conn->write_self_);
+
+  conn->writing_ = false;
+  conn->flush_buf_.clear();
+  conn->flush_buf_.shrink();
+  conn->flush_refs_.clear();
+
+  // replies appended while writing
+  if (status == 0) {
+    conn->Flush();
+  } else {
+    conn->wbuf_.clear();
+    conn->wbuf_.shrink();
+    conn->wrefs_.clear();
+  }
+  conn->CloseIfDone();
+}
+
 void RockinConn::OnAlloc(size_t suggested_size, uv_buf_t *buf) {
   if (buf_.writeable() == 0) {
     buf_.expand();
@@ -187,7 +321,7 @@ void RockinConn::OnRead(ssize_t nread, const uv_buf_t *buf) {
 
   buf_.move_writeptr(nread);
 
-  while (true) {
+  while (!close_after_) {
     if (cmd_args_ == nullptr) {
       cmd_args_ = std::make_shared<CmdArgs>();
     }
@@ -198,6 +332,7 @@ void RockinConn::OnRead(ssize_t nread, const uv_buf_t *buf) {
     }
 
     if (cmd_args_->is_ok() == false) {
+      buf_.shrink();
       break;
     }
 
@@ -206,154 +341,61 @@ void RockinConn::OnRead(ssize_t nread, const uv_buf_t *buf) {
       continue;
     }
 
+    uint64_t seq = BeginReply();
     auto &args = cmd_args_->args();
     if (args[0]->len == 4 && args[0]->data[0] == 'q' &&
         args[0]->data[1] == 'u' && args[0]->data[2] == 'i' &&
         args[0]->data[3] == 't') {
       ReplyOk();
-      return Close();
+      ReleaseReply(seq);
+      return CloseAfterReplies();
     }
 
     Workers::Default()->HandeCmd(shared_from_this(), cmd_args_);
     cmd_args_.reset();
+    ReleaseReply(seq);
   }
 }
 
 //////////////////////////////////////////////////////
 
-void RockinConn::ReplyNil() {
-  static BufPtr g_nil = make_buffer("$-1\r\n");
-  std::vector<BufPtr> datas;
-  datas.push_back(g_nil);
-  WriteData(std::move(datas));
-}
+void RockinConn::ReplyNil() { WriteData(rockin::ReplyNil()); }
 
-void RockinConn::ReplyOk() {
-  static BufPtr g_reply_ok = make_buffer("+OK\r\n");
-  std::vector<BufPtr> datas;
-  datas.push_back(g_reply_ok);
-  WriteData(std::move(datas));
-}
+void RockinConn::ReplyOk() { WriteData(rockin::ReplyOk()); }
 
 void RockinConn::ReplyIntegerError() {
-  static BufPtr g_integer_err =
-      make_buffer("-ERR value is not an integer or out of range\r\n");
-  std::vector<BufPtr> datas;
-  datas.push_back(g_integer_err);
-  WriteData(std::move(datas));
+  WriteData(rockin::ReplyIntegerError());
 }
 
-void RockinConn::ReplySyntaxError() {
-  static BufPtr g_syntax_err = make_buffer("-ERR syntax error\r\n");
-  std::vector<BufPtr> datas;
-  datas.push_back(g_syntax_err);
-  WriteData(std::move(datas));
-}
+void RockinConn::ReplySyntaxError() { WriteData(rockin::ReplySyntaxError()); }
 
-void RockinConn::ReplyError(BufPtr err) {
-  static BufPtr g_begin_err = make_buffer("-");
-  static BufPtr g_proto_split = make_buffer("\r\n");
+void RockinConn::ReplyError(BufPtr err) { WriteData(rockin::ReplyError(err)); }
 
-  std::vector<BufPtr> datas;
-  datas.push_back(g_begin_err);
-  datas.push_back(err);
-  datas.push_back(g_proto_split);
-  WriteData(std::move(datas));
-}
-
-void RockinConn::ReplyTypeError() {
-  static BufPtr g_reply_type_warn = make_buffer(
-      "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
-
-  std::vector<BufPtr> datas;
-  datas.push_back(g_reply_type_warn);
-  WriteData(std::move(datas));
-}
+void RockinConn::ReplyTypeError() { WriteData(rockin::ReplyTypeError()); }
 
 void RockinConn::ReplyErrorAndClose(BufPtr err) {
+  uint64_t seq = BeginReply();
   ReplyError(err);
-  Close();
+  ReleaseReply(seq);
+  CloseAfterReplies();
 }
 
 void RockinConn::ReplyString(BufPtr str) {
-  if (str == nullptr) {
-    ReplyNil();
-    return;
-  }
-
-  static BufPtr g_begin_str = make_buffer("+");
-  static BufPtr g_proto_split = make_buffer("\r\n");
-
-  std::vector<BufPtr> datas;
-  datas.push_back(g_begin_str);
-  datas.push_back(str);
-  datas.push_back(g_proto_split);
-  WriteData(std::move(datas));
+  WriteData(rockin::ReplyString(str));
 }
 
 void RockinConn::ReplyInteger(int64_t num) {
-  static BufPtr g_begin_int = make_buffer(":");
-  static BufPtr g_proto_split = make_buffer("\r\n");
-
-  std::vector<BufPtr> datas;
-  datas.push_back(g_begin_int);
-  datas.push_back(make_buffer(Int64ToString(num)));
-  datas.push_back(g_proto_split);
-  WriteData(std::move(datas));
+  WriteData(rockin::ReplyInteger(num));
 }
 
-void RockinConn::ReplyBulk(BufPtr str) {
-  if (str == nullptr) {
-    ReplyNil();
-    return;
-  }
-
-  static BufPtr g_begin_bulk = make_buffer("$");
-  static BufPtr g_proto_split = make_buffer("\r\n");
-
-  std::vector<BufPtr> datas;
-  datas.push_back(g_begin_bulk);
-  datas.push_back(make_buffer(Int64ToString(str->len)));
-  datas.push_back(g_proto_split);
-  datas.push_back(str);
-  datas.push_back(g_proto_split);
-  WriteData(std::move(datas));
-}
+void RockinConn::ReplyBulk(BufPtr str) { WriteData(rockin::ReplyBulk(str)); }
 
 void RockinConn::ReplyArray(std::vector<BufPtr> &values) {
-  static BufPtr g_begin_array = make_buffer("*");
-  static BufPtr g_begin_bulk = make_buffer("$");
-  static BufPtr g_proto_split = make_buffer("\r\n");
-  static BufPtr g_nil = make_buffer("$-1\r\n");
-
-  std::vector<BufPtr> datas;
-  datas.push_back(g_begin_array);
-  datas.push_back(make_buffer(Int64ToString(values.size())));
-  datas.push_back(g_proto_split);
-  for (size_t i = 0; i < values.size(); i++) {
-    if (values[i] == nullptr) {
-      datas.push_back(g_nil);
-    } else {
-      datas.push_back(g_begin_bulk);
-      datas.push_back(make_buffer(Int64ToString(values[i]->len)));
-      datas.push_back(g_proto_split);
-      datas.push_back(values[i]);
-      datas.push_back(g_proto_split);
-    }
-  }
-  WriteData(std::move(datas));
+  WriteData(rockin::ReplyArray(values));
 }
 
-void RockinConn::ReplyObj(std::shared_ptr<object_t> obj) {
-  if (obj == nullptr) {
-    ReplyNil();
-  } else if (obj->type == Type_String && obj->encode == Encode_Raw) {
-    auto str_value = std::static_pointer_cast<buffer_t>(obj->value);
-    ReplyBulk(str_value);
-  } else if (obj->type == Type_String && obj->encode == Encode_Int) {
-    auto str_value = std::static_pointer_cast<buffer_t>(obj->value);
-    ReplyInteger(*((int64_t *)str_value->data));
-  }
+void RockinConn::ReplyObj(ObjPtr obj) {
+  WriteData(rockin::ReplyObj(obj));
 }
 
 }  // namespace rockin
\ No newline at end of file
@@ -1,13 +1,92 @@
 #include "type_control.h"
 #include <glog/logging.h>
 #include <jemalloc/jemalloc.h>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_set>
 #include "cmd_args.h"
+#include "cmd_reply.h"
 #include "disk_saver.h"
 #include "mem_saver.h"
 #include "rockin_conn.h"
+#include "type_string.h"
 
 namespace rockin {
 
+// a meta of a key not deleted, expired or malformed
+static inline bool MetaLive(const std::string &meta, uint64_t now) {
+  if (meta.length() < BASE_META_VALUE_SIZE) return false;
+
+  uint64_t expire = META_VALUE_EXPIRE(meta.c_str());
+  return META_VALUE_TYPE(meta.c_str()) != Type_None &&
+         (expire == 0 || now < expire);
+}
+
+// the meta of key, false when it is missing or expired
+static bool GetLiveMeta(BufPtr key, std::string &meta) {
+  bool exist = false;
+  meta = DiskSaver::Default()->GetMeta(key, exist);
+  return exist && MetaLive(meta, GetMilliSec());
+}
+
+// the meta of a deleted key stays as a Type_None meta of the next version,
+// as the compaction filter leaves expired keys, so the key stays in the
+// key filter and a new object of it continues the versions. only the meta
+// is written, the bulks of the old version no longer match it and are
+// dropped by the data compaction filter
+static void DeleteKey(BufPtr key, const std::string &meta,
+                      DiskWriteBatch &batch) {
+  BufPtr none_meta = make_buffer(BASE_META_VALUE_SIZE, Mem_Disk);
+  memset(none_meta->data, 0, BASE_META_VALUE_SIZE);
+  SET_META_VERSION(none_meta->data, META_VALUE_VERSION(meta.c_str()) + 1);
+  batch.SetMeta(key, none_meta);
+  MemSaver::Default()->DeleteObj(key);
+}
+
+// bulks an expire cycle deletes for each key it may take, the bulks of the
+// keys past it are left to the data compaction filter
+#define EXPIRE_CYCLE_KEY_BULKS 16
+
+size_t ActiveExpire(uint64_t now, size_t max) {
+  BufPtrs keys = MemSaver::Default()->GetExpiredKeys(now, max);
+  if (keys.empty()) return 0;
+
+  std::vector<bool> exists;
+  auto metas = DiskSaver::Default()->GetMetas(keys, exists);
+
+  // keys removed, persisted or expiring later since they were added are
+  // skipped. the bulks of expired keys are deleted in the same batch while
+  // the cycle has room for them, so they leave the block cache now instead
+  // of when compaction visits them
+  DiskWriteBatch batch;
+  size_t deleted = 0;
+  size_t bulks = max * EXPIRE_CYCLE_KEY_BULKS;
+  for (size_t i = 0; i < keys.size(); i++) {
+    const std::string &meta = metas[i];
+    if (!exists[i] || meta.length() < BASE_META_VALUE_SIZE) continue;
+
+    uint64_t expire = META_VALUE_EXPIRE(meta.c_str());
+    if (META_VALUE_TYPE(meta.c_str()) == Type_None || expire == 0 ||
+        expire > now) {
+      continue;
+    }
+
+    DeleteKey(keys[i], meta, batch);
+    deleted++;
+
+    BufPtrs value_keys = GetStringValueKeys(keys[i], meta);
+    if (!value_keys.empty() && value_keys.size() <= bulks) {
+      batch.DeleteValues(keys[i], value_keys);
+      bulks -= value_keys.size();
+    }
+  }
+
+  if (deleted > 0 && !DiskSaver::Default()->Write(batch)) {
+    LOG(ERROR) << "active expire write " << deleted << " keys fail";
+  }
+  return keys.size();
+}
+
 void CommandCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                     std::shared_ptr<RockinConn> conn) {
   conn->ReplyOk();
@@ -19,277 +98,258 @@ void PingCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
   conn->ReplyString(g_reply_pong);
 }
 
+// the dbs with keys, as estimated by rocksdb
+static std::string Keyspace() {
+  auto counts = DiskSaver::Default()->EstimateDBKeys();
+  std::string info = "# Keyspace\r\n";
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i] == 0) continue;
+    info += Format("db%d:keys=%llu\r\n", (int)i,
+                   (unsigned long long)counts[i]);
+  }
+  return info;
+}
+
 void InfoCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                  std::shared_ptr<RockinConn> conn) {
-  //....
-  conn->ReplyOk();
+  std::string info = memory_info();
+  info += "\r\n";
+  info += MemSaver::Default()->Info();
+  info += "\r\n";
+  info += DiskSaver::Default()->Info();
+  info += "\r\n";
+  info += Keyspace();
+  conn->ReplyBulk(make_buffer(info, Mem_Replies));
 }
 
 void DelCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                 std::shared_ptr<RockinConn> conn) {
-  /*  int cnt = cmd_args->args().size() - 1;
-   auto rets = std::make_shared<MultiResult>(cnt);
-
-   for (int i = 0; i < cnt; i++) {
-     MemSaver::Default()->DoCmd(
-         cmd_args->args()[i + 1],
-         [cmd_args, conn, rets, i](EventLoop *lt, std::shared_ptr<void> arg) {
-           auto db = std::static_pointer_cast<MemDB>(arg);
-           if (db->Delete(conn->index(), cmd_args->args()[i + 1])) {
-             rets->int_value.fetch_add(1);
-           }
-
-           rets->cnt--;
-           if (rets->cnt.load() == 0) {
-             conn->ReplyInteger(rets->int_value.load());
-           }
-         });
-   }*/
+  auto &args = cmd_args->args();
+  BufPtrs keys(args.begin() + 1, args.end());
+  auto deleted = std::make_shared<std::atomic<int64_t>>(0);
+  auto ok = std::make_shared<std::atomic<bool>>(true);
+
+  // each worker reads the metas of its keys in one MultiGet and deletes
+  // them in one batch, a key given twice is deleted once. only the keys of
+  // committed batches are counted, the cached objects dropped for a failed
+  // one are read again from rocksdb
+  Workers::Default()->AsyncWork(
+      keys, conn,
+      [keys, deleted, ok](const std::vector<size_t> &idxs) {
+        std::unordered_set<std::string> seen;
+        BufPtrs group;
+        for (size_t i = 0; i < idxs.size(); i++) {
+          BufPtr key = keys[idxs[i]];
+          if (seen.insert(std::string(key->data, key->len)).second) {
+            group.push_back(key);
+          }
+        }
+
+        std::vector<bool> exists;
+        auto metas = DiskSaver::Default()->GetMetas(group, exists);
+
+        DiskWriteBatch batch;
+        uint64_t now = GetMilliSec();
+        int64_t n = 0;
+        for (size_t i = 0; i < group.size(); i++) {
+          if (!exists[i] || !MetaLive(metas[i], now)) continue;
+          DeleteKey(group[i], metas[i], batch);
+          n++;
+        }
+
+        if (n > 0 && !DiskSaver::Default()->Write(batch)) {
+          ok->store(false);
+          return;
+        }
+        deleted->fetch_add(n);
+      },
+      [deleted, ok]() {
+        return ok->load() ? ReplyInteger(deleted->load()) : ReplyWriteError();
+      });
 }
 
+// the db is kept by the connection, the keys of its next commands are made
+// db keys of it
 void SelectCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                    std::shared_ptr<RockinConn> conn) {
-  /*  int64_t dbnum = 0;
-   auto &args = cmd_args->args();
-   static BufPtr g_reply_dbindex_invalid = make_buffer("ERR invalid DB index");
-   static BufPtr g_reply_dbindex_range =
-       make_buffer("ERR DB index is out of range");
-
-   if (StringToInt64(args[1]->data, args[1]->len, &dbnum) != 1) {
-     conn->ReplyError(g_reply_dbindex_invalid);
-     return;
-   }
-
-   if (dbnum < 0 || dbnum >= DBNum) {
-     conn->ReplyError(g_reply_dbindex_range);
-     return;
-   }
-
-   conn->set_index(dbnum);
-   conn->ReplyOk();*/
+  int64_t dbnum = 0;
+  auto &args = cmd_args->args();
+  static BufPtr g_reply_dbindex_invalid = make_buffer("ERR invalid DB index");
+  static BufPtr g_reply_dbindex_range =
+      make_buffer("ERR DB index is out of range");
+
+  if (StringToInt64(args[1]->data, args[1]->len, &dbnum) != 1) {
+    conn->ReplyError(g_reply_dbindex_invalid);
+    return;
+  }
+
+  if (dbnum < 0 || dbnum >= DB_NUM) {
+    conn->ReplyError(g_reply_dbindex_range);
+    return;
+  }
+
+  conn->set_index(dbnum);
+  conn->ReplyOk();
+}
+
+// the workers of one flush meet here, each after the commands queued to it
+// before the flush. the last one to arrive flushes db, or every db when db
+// is -1, in rocksdb while the others wait, so no write of an earlier
+// command commits after the flush
+struct FlushBarrier {
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t left;
+  bool ok;
+};
+
+static void WaitFlush(std::shared_ptr<FlushBarrier> barrier, int db) {
+  std::unique_lock<std::mutex> lock(barrier->mutex);
+  if (--barrier->left > 0) {
+    barrier->cond.wait(lock, [barrier]() { return barrier->left == 0; });
+    return;
+  }
+
+  barrier->ok = db < 0 ? DiskSaver::Default()->Flush()
+                       : DiskSaver::Default()->FlushDB(db);
+  barrier->cond.notify_all();
+}
+
+// every worker drops its cached objects of db once the flush is done, so no
+// object read from rocksdb before the flush stays cached after it. the work is queued to
+// every worker or to none, and flushes are queued one at a time so every
+// worker meets them in the same order, a worker waiting for one flush never
+// holds the items of another
+static void Flush(std::shared_ptr<RockinConn> conn, int db) {
+  static std::mutex queue_mutex;
+  auto barrier = std::make_shared<FlushBarrier>();
+  barrier->left = Workers::Default()->thread_num();
+  barrier->ok = true;
+
+  std::lock_guard<std::mutex> lock(queue_mutex);
+  Workers::Default()->AsyncWorkAll(
+      conn,
+      [barrier, db]() {
+        WaitFlush(barrier, db);
+        if (db < 0)
+          MemSaver::Default()->Clear();
+        else
+          MemSaver::Default()->ClearDB(db);
+      },
+      [barrier]() {
+        static BufPtr g_reply_flush_err = make_buffer("ERR flush fail");
+        return barrier->ok ? ReplyOk() : ReplyError(g_reply_flush_err);
+      });
 }
 
 void FlushDBCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                     std::shared_ptr<RockinConn> conn) {
-  /*  const auto &dbs = MemSaver::Default()->dbs();
-   auto rets = std::make_shared<MultiResult>(dbs.size());
-   for (auto iter = dbs.begin(); iter != dbs.end(); ++iter) {
-     iter->first->RunInLoopNoWait(
-         [cmd_args, conn, rets](EventLoop *lt, std::shared_ptr<void> arg) {
-           auto db = std::static_pointer_cast<MemDB>(arg);
-           db->FlushDB(conn->index());
-
-           rets->cnt--;
-           if (rets->cnt.load() == 0) {
-             conn->ReplyOk();
-           }
-         },
-         iter->second);
-   }*/
+  Flush(conn, conn->index());
 }
 
 void FlushAllCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                      std::shared_ptr<RockinConn> conn) {
-  /*  const auto &dbs = MemSaver::Default()->dbs();
-   auto rets = std::make_shared<MultiResult>(dbs.size());
-   for (auto iter = dbs.begin(); iter != dbs.end(); ++iter) {
-     iter->first->RunInLoopNoWait(
-         [cmd_args, conn, rets](EventLoop *lt, std::shared_ptr<void> arg) {
-           auto db = std::static_pointer_cast<MemDB>(arg);
-           for (int i = 0; i < DBNum; i++) {
-             db->FlushDB(i);
-           }
-
-           rets->cnt--;
-           if (rets->cnt.load() == 0) {
-             conn->ReplyOk();
-           }
-         },
-         iter->second);
-   }*/
+  Flush(conn, -1);
 }
 
-void TTLCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
-                std::shared_ptr<RockinConn> conn) {
-  /* MemSaver::Default()->DoCmd(
-      cmd_args->args()[1], [cmd_args, conn, cmd = shared_from_this()](
-                               EventLoop *lt, std::shared_ptr<void> arg) {
-        auto db = std::static_pointer_cast<MemDB>(arg);
-        auto &args = cmd_args->args();
-
-        auto obj = db->Get(conn->index(), args[1]);
-        if (obj == nullptr) {
-          std::string meta;
-          uint32_t version;
-          obj = cmd->GetMeta(conn->index(), args[1], meta, version);
-          if (obj == nullptr) {
-            conn->ReplyInteger(-2);
-            return;
-          }
-        }
+// a cached object answers without reading rocksdb
+static BufPtrs DoTTL(BufPtr key, bool ms) {
+  uint64_t expire = 0;
+  auto obj = MemSaver::Default()->GetObj(key);
+  if (obj != nullptr) {
+    expire = obj->expire;
+  } else {
+    std::string meta;
+    if (!GetLiveMeta(key, meta)) return ReplyInteger(-2);
+    expire = META_VALUE_EXPIRE(meta.c_str());
+  }
+
+  if (expire == 0) return ReplyInteger(-1);
+
+  uint64_t cur_ms = GetMilliSec();
+  if (cur_ms >= expire) return ReplyInteger(-2);
+  return ReplyInteger(ms ? expire - cur_ms : (expire - cur_ms + 500) / 1000);
+}
 
-        uint64_t cur_ms = GetMilliSec();
-        if (obj->expire == 0) {
-          conn->ReplyInteger(-1);
-          return;
-        } else if (cur_ms >= obj->expire) {
-          conn->ReplyInteger(-2);
-          return;
-        }
+// the expire time in milliseconds of arg, which is in unit ms from now when
+// relative, or from the epoch. a time already passed expires the key
+static bool ParseExpire(BufPtr arg, int64_t unit, bool relative,
+                        uint64_t &expire_ms) {
+  int64_t value = 0;
+  if (StringToInt64(arg->data, arg->len, &value) != 1) return false;
 
-        conn->ReplyInteger((obj->expire - cur_ms) / 1000);
-      });*/
-}
+  int64_t cur_ms = GetMilliSec();
+  int64_t base = relative ? cur_ms : 0;
+  if (value > (INT64_MAX - base) / unit || value < INT64_MIN / unit)
+    return false;
 
-void PTTLCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
-                 std::shared_ptr<RockinConn> conn) {
-  /*  MemSaver::Default()->DoCmd(
-       cmd_args->args()[1], [cmd_args, conn, cmd = shared_from_this()](
-                                EventLoop *lt, std::shared_ptr<void> arg) {
-         auto db = std::static_pointer_cast<MemDB>(arg);
-         auto &args = cmd_args->args();
-
-         auto obj = db->Get(conn->index(), args[1]);
-         if (obj == nullptr) {
-           std::string meta;
-           uint32_t version;
-           obj = cmd->GetMeta(conn->index(), args[1], meta, version);
-           if (obj == nullptr) {
-             conn->ReplyInteger(-2);
-             return;
-           }
-         }
-
-         uint64_t cur_ms = GetMilliSec();
-         if (obj->expire == 0) {
-           conn->ReplyInteger(-1);
-           return;
-         } else if (cur_ms >= obj->expire) {
-           conn->ReplyInteger(-2);
-           return;
-         }
-
-         conn->ReplyInteger(obj->expire - cur_ms);
-       });*/
+  int64_t ms = base + value * unit;
+  expire_ms = ms > cur_ms ? ms : cur_ms;
+  return true;
 }
 
-/* static bool DoExpire(std::shared_ptr<Cmd> cmd, std::shared_ptr<MemDB> db,
-                     int dbindex, BufPtr key, uint64_t expire_ms) {
-  std::string meta_str;
-  uint32_t version;
-  auto obj_meta = cmd->GetMeta(dbindex, key, meta_str, version);
-  if (obj_meta == nullptr) return false;
+// only the meta is rewritten, the bulks are not touched. the cache is
+// updated once the meta is committed
+static BufPtrs DoExpire(BufPtr key, uint64_t expire_ms) {
+  std::string meta;
+  if (!GetLiveMeta(key, meta)) return ReplyInteger(0);
 
-  auto meta_ptr = make_buffer(meta_str);
-  SET_META_EXPIRE(meta_ptr->data, expire_ms);
+  BufPtr new_meta = make_buffer(meta.data(), meta.length(), Mem_Disk);
+  SET_META_EXPIRE(new_meta->data, expire_ms);
+  if (!DiskSaver::Default()->Set(key, new_meta)) return ReplyWriteError();
 
-  auto diskdb = DiskSaver::Default()->GetDB(key);
-  diskdb->SetMeta(dbindex, key, meta_ptr);
+  MemSaver::Default()->UpdateExpire(key, expire_ms);
+  return ReplyInteger(1);
+}
 
-  auto obj = db->Get(dbindex, key);
-  if (obj != nullptr) db->UpdateExpire(dbindex, obj, expire_ms);
-  return true;
-}*/
+// EXPIRE, PEXPIRE, EXPIREAT and PEXPIREAT, run by the worker of the key
+static void ExpireKey(std::shared_ptr<CmdArgs> cmd_args,
+                      std::shared_ptr<RockinConn> conn, int64_t unit,
+                      bool relative) {
+  auto &args = cmd_args->args();
+  uint64_t expire_ms = 0;
+  if (!ParseExpire(args[2], unit, relative, expire_ms)) {
+    conn->ReplyIntegerError();
+    return;
+  }
+
+  Workers::Default()->AsyncWork(args[1], conn, [cmd_args, expire_ms]() {
+    return DoExpire(cmd_args->args()[1], expire_ms);
+  });
+}
+
+void TTLCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
+                std::shared_ptr<RockinConn> conn) {
+  Workers::Default()->AsyncWork(cmd_args->args()[1], conn, [cmd_args]() {
+    return DoTTL(cmd_args->args()[1], false);
+  });
+}
+
+void PTTLCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
+                 std::shared_ptr<RockinConn> conn) {
+  Workers::Default()->AsyncWork(cmd_args->args()[1], conn, [cmd_args]() {
+    return DoTTL(cmd_args->args()[1], true);
+  });
+}
 
 void ExpireCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                    std::shared_ptr<RockinConn> conn) {
-  /*  MemSaver::Default()->DoCmd(
-       cmd_args->args()[1], [cmd_args, conn, cmd = shared_from_this()](
-                                EventLoop *lt, std::shared_ptr<void> arg) {
-         auto db = std::static_pointer_cast<MemDB>(arg);
-         auto &args = cmd_args->args();
-
-         int64_t expire_time = 0;
-         if (StringToInt64(args[2]->data, args[2]->len, &expire_time) != 1) {
-           conn->ReplyIntegerError();
-           return;
-         }
-
-         if (expire_time <= 0)
-           expire_time = GetMilliSec();
-         else
-           expire_time = GetMilliSec() + expire_time * 1000;
-
-         if (!DoExpire(cmd, db, conn->index(), args[1], expire_time))
-           conn->ReplyInteger(0);
-         else
-           conn->ReplyInteger(1);
-       });*/
+  ExpireKey(cmd_args, conn, 1000, true);
 }
 
 void PExpireCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                     std::shared_ptr<RockinConn> conn) {
-  /* MemSaver::Default()->DoCmd(
-      cmd_args->args()[1], [cmd_args, conn, cmd = shared_from_this()](
-                               EventLoop *lt, std::shared_ptr<void> arg) {
-        auto db = std::static_pointer_cast<MemDB>(arg);
-        auto &args = cmd_args->args();
-
-        int64_t expire_time = 0;
-        if (StringToInt64(args[2]->data, args[2]->len, &expire_time) != 1) {
-          conn->ReplyIntegerError();
-          return;
-        }
-
-        if (expire_time <= 0)
-          expire_time = GetMilliSec();
-        else
-          expire_time = GetMilliSec() + expire_time * 1000;
-
-        if (!DoExpire(cmd, db, conn->index(), args[1], expire_time))
-          conn->ReplyInteger(0);
-        else
-          conn->ReplyInteger(1);
-      });*/
+  ExpireKey(cmd_args, conn, 1, true);
 }
 
 void ExpireAtCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                      std::shared_ptr<RockinConn> conn) {
-  /*  MemSaver::Default()->DoCmd(
-       cmd_args->args()[1], [cmd_args, conn, cmd = shared_from_this()](
-                                EventLoop *lt, std::shared_ptr<void> arg) {
-         auto db = std::static_pointer_cast<MemDB>(arg);
-         auto &args = cmd_args->args();
-
-         int64_t expire_time = 0;
-         if (StringToInt64(args[2]->data, args[2]->len, &expire_time) != 1) {
-           conn->ReplyIntegerError();
-           return;
-         }
-
-         expire_time = expire_time * 1000;
-         uint64_t cur_time = GetMilliSec();
-         if (expire_time <= cur_time) expire_time = cur_time;
-
-         if (!DoExpire(cmd, db, conn->index(), args[1], expire_time))
-           conn->ReplyInteger(0);
-         else
-           conn->ReplyInteger(1);
-       });*/
+  ExpireKey(cmd_args, conn, 1000, false);
 }
 
 void PExpireAtCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                       std::shared_ptr<RockinConn> conn) {
-  /* MemSaver::Default()->DoCmd(
-      cmd_args->args()[1], [cmd_args, conn, cmd = shared_from_this()](
-                               EventLoop *lt, std::shared_ptr<void> arg) {
-        auto db = std::static_pointer_cast<MemDB>(arg);
-        auto &args = cmd_args->args();
-
-        int64_t expire_time = 0;
-        if (StringToInt64(args[2]->data, args[2]->len, &expire_time) != 1) {
-          conn->ReplyIntegerError();
-          return;
-        }
-
-        uint64_t cur_time = GetMilliSec();
-        if (expire_time <= cur_time) expire_time = cur_time;
-
-        if (!DoExpire(cmd, db, conn->index(), args[1], expire_time))
-          conn->ReplyInteger(0);
-        else
-          conn->ReplyInteger(1);
-      });*/
+  ExpireKey(cmd_args, conn, 1, false);
 }
 
 void CompactCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
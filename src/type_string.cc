@@ -12,7 +12,7 @@
 
 // rocksdb save protocol
 //
-// meta key ->  key
+// meta key ->  db key
 //
 // meta value-> |     meta value header     |   bulk   |
 //              |     BASE_META_SIZE byte   |  2 byte  |
@@ -30,28 +30,34 @@
 #define STRING_FIELD_KEY_SIZE(len) \
   BASE_FIELD_KEY_SIZE(len) + STRING_FIELD_KEY_BULK_SIZE
 
-#define OBJ_STRING(obj) std::static_pointer_cast<buffer_t>(obj->value)
+#define OBJ_INT64(obj) (*((int64_t *)(obj)->value_data()))
 #define BUF_INT64(v) (*((int64_t *)v->data))
 
 #define STRING_BULK(len) \
   ((len) / STRING_MAX_BULK_SIZE + (((len) % STRING_MAX_BULK_SIZE) ? 1 : 0))
 
+// the bulk number is saved in 2 bytes
+#define STRING_MAX_SIZE (STRING_MAX_BULK_SIZE * 0xFFFFLL)
+
 namespace rockin {
 
-static inline BufPtr GenString(BufPtr value, int encode) {
-  if (value != nullptr && encode == Encode_Int) {
-    return make_buffer(Int64ToString(BUF_INT64(value)));
+static BufPtr g_reply_string_size_err =
+    make_buffer("ERR string exceeds maximum allowed size");
+
+static inline BufPtr GenString(ObjPtr obj) {
+  if (obj->encode == Encode_Int) {
+    return make_buffer(Int64ToString(OBJ_INT64(obj)), Mem_Replies);
   }
 
-  return value;
+  return object_value(obj);
 }
 
-static inline bool GenInt64(BufPtr str, int encode, int64_t &v) {
-  if (encode == Encode_Int) {
-    v = BUF_INT64(str);
+static inline bool GenInt64(ObjPtr obj, int64_t &v) {
+  if (obj->encode == Encode_Int) {
+    v = OBJ_INT64(obj);
     return true;
   } else {
-    if (StringToInt64(str->data, str->len, &v)) {
+    if (StringToInt64(obj->value_data(), obj->value_size(), &v)) {
       return true;
     }
   }
@@ -62,7 +68,7 @@ static inline BufPtrs GetStringFieldKeys(BufPtr mkey, uint32_t version,
                                          uint16_t bulk) {
   BufPtrs field_keys;
   for (int i = 0; i < bulk; i++) {
-    auto field_key = make_buffer(STRING_FIELD_KEY_SIZE(mkey->len));
+    auto field_key = make_buffer(STRING_FIELD_KEY_SIZE(mkey->len), Mem_Disk);
     SET_FIELD_KEY_HEADER(STRING_FLAG, field_key->data, mkey->data, mkey->len,
                          version);
     EncodeFixed16(field_key->data + BASE_FIELD_KEY_SIZE(mkey->len), i);
@@ -76,7 +82,7 @@ static inline KVPairS GetStringFieldKeyValues(BufPtr mkey, uint32_t version,
                                               BufPtr value) {
   KVPairS kvs;
   if (value->len < STRING_MAX_BULK_SIZE) {
-    auto field_key = make_buffer(STRING_FIELD_KEY_SIZE(mkey->len));
+    auto field_key = make_buffer(STRING_FIELD_KEY_SIZE(mkey->len), Mem_Disk);
     SET_FIELD_KEY_HEADER(STRING_FLAG, field_key->data, mkey->data, mkey->len,
                          version);
     EncodeFixed16(field_key->data + BASE_FIELD_KEY_SIZE(mkey->len), 0);
@@ -84,15 +90,16 @@ static inline KVPairS GetStringFieldKeyValues(BufPtr mkey, uint32_t version,
   } else {
     int bulk = STRING_BULK(value->len);
     for (int i = 0; i < bulk; i++) {
-      auto field_key = make_buffer(STRING_FIELD_KEY_SIZE(mkey->len));
+      auto field_key = make_buffer(STRING_FIELD_KEY_SIZE(mkey->len), Mem_Disk);
       SET_FIELD_KEY_HEADER(STRING_FLAG, field_key->data, mkey->data, mkey->len,
                            version);
       EncodeFixed16(field_key->data + BASE_FIELD_KEY_SIZE(mkey->len), i);
 
-      auto field_value = make_buffer();
-      field_value->data = value->data + (i * STRING_MAX_BULK_SIZE);
-      field_value->len = (i == (bulk - 1) ? (value->len % STRING_MAX_BULK_SIZE)
-                                          : STRING_MAX_BULK_SIZE);
+      auto field_value = make_view(
+          value, value->data + (i * STRING_MAX_BULK_SIZE),
+          i == (bulk - 1) ? (value->len % STRING_MAX_BULK_SIZE)
+                          : STRING_MAX_BULK_SIZE,
+          Mem_Disk);
 
       kvs.push_back(std::make_pair(field_key, field_value));
     }
@@ -100,6 +107,16 @@ static inline KVPairS GetStringFieldKeyValues(BufPtr mkey, uint32_t version,
   return std::move(kvs);
 }
 
+BufPtrs GetStringValueKeys(BufPtr mkey, const std::string &meta) {
+  if (meta.length() != BASE_META_VALUE_SIZE + STRING_META_VALUE_SIZE ||
+      META_VALUE_TYPE(meta.c_str()) != Type_String) {
+    return BufPtrs();
+  }
+
+  return GetStringFieldKeys(mkey, META_VALUE_VERSION(meta.c_str()),
+                            DecodeFixed16(meta.c_str() + BASE_META_VALUE_SIZE));
+}
+
 // key object  version type_err
 static inline ObjPtr GetMetaResult(bool exist, BufPtr mkey,
                                    const std::string &meta, uint32_t &version,
@@ -115,7 +132,7 @@ static inline ObjPtr GetMetaResult(bool exist, BufPtr mkey,
 
   version = META_VALUE_VERSION(meta.c_str());
   uint8_t type = META_VALUE_TYPE(meta.c_str());
-  uint16_t expire = META_VALUE_EXPIRE(meta.c_str());
+  uint64_t expire = META_VALUE_EXPIRE(meta.c_str());
 
   if (type == Type_None || (expire > 0 && GetMilliSec() >= expire)) {
     return nullptr;
@@ -135,32 +152,46 @@ static inline ObjPtr GetMetaResult(bool exist, BufPtr mkey,
   return obj;
 }
 
+// the object of meta obj whose bulks are values[begin, end), they are
+// joined into its inline value
 static inline ObjPtr GetValuesResult(ObjPtr obj,
                                      const std::vector<bool> &exists,
-                                     const std::vector<std::string> &values) {
-  if (exists.size() == 0 || values.size() != values.size()) {
+                                     const std::vector<std::string> &values,
+                                     size_t begin, size_t end) {
+  if (begin >= end || exists.size() != values.size() || end > values.size()) {
     return nullptr;
   }
 
   size_t value_length = 0;
-  for (size_t i = 0; i < exists.size(); i++) {
+  for (size_t i = begin; i < end; i++) {
     if (!exists[i]) {
       return nullptr;
     }
     value_length += values[i].length();
   }
 
+  auto value_obj = make_object(obj->key_data(), obj->key_len, value_length);
+  value_obj->type = obj->type;
+  value_obj->encode = obj->encode;
+  value_obj->version = obj->version;
+  value_obj->expire = obj->expire;
+
   size_t offset = 0;
-  auto value = make_buffer(value_length);
-  for (size_t i = 0; i < values.size(); i++) {
-    memcpy(value->data + offset, values[i].c_str(), values[i].length());
+  for (size_t i = begin; i < end; i++) {
+    memcpy(value_obj->value_data() + offset, values[i].c_str(),
+           values[i].length());
     offset += values[i].length();
   }
-  obj->value = value;
-  return obj;
+  return value_obj;
+}
+
+static inline ObjPtr GetValuesResult(ObjPtr obj,
+                                     const std::vector<bool> &exists,
+                                     const std::vector<std::string> &values) {
+  return GetValuesResult(obj, exists, values, 0, values.size());
 }
 
-ObjPtr GetStringObj(BufPtr key, uint32_t &version, bool type_err) {
+ObjPtr GetStringObj(BufPtr key, uint32_t &version, bool &type_err) {
   version = 0;
   type_err = false;
 
@@ -195,24 +226,86 @@ ObjPtr GetStringObj(BufPtr key, uint32_t &version, bool type_err) {
   return obj;
 }
 
-ObjPtr UpdateStringObj(ObjPtr obj, BufPtr key, BufPtr value, uint8_t encode,
-                       uint32_t version, uint64_t expire, bool update_meta) {
-  if (update_meta) version++;
-  auto new_obj = obj;
-  if (new_obj == nullptr) {
-    new_obj = make_object(key);
-    new_obj->expire = expire;
+// GetStringObj of keys owned by one worker, metas and values of the keys
+// not in memory are read by one batch each. a missing key or a key of
+// another type gets nullptr
+static ObjPtrs GetStringObjs(const BufPtrs &keys) {
+  ObjPtrs objs(keys.size());
+
+  // step1, get objects from memory
+  std::vector<size_t> misses;
+  BufPtrs miss_keys;
+  for (size_t i = 0; i < keys.size(); i++) {
+    auto obj = MemSaver::Default()->GetObj(keys[i]);
+    if (obj == nullptr) {
+      misses.push_back(i);
+      miss_keys.push_back(keys[i]);
+    } else if (obj->type == Type_String) {
+      objs[i] = obj;
+    }
+  }
+  if (misses.empty()) return objs;
+
+  // step2, get metas from rocksdb
+  std::vector<bool> exists;
+  auto metas = DiskSaver::Default()->GetMetas(miss_keys, exists);
+
+  // step3, get field values of all found keys from rocksdb
+  ObjPtrs miss_objs(misses.size());
+  std::vector<size_t> begins(misses.size() + 1, 0);
+  BufPtrs field_mkeys, field_keys;
+  for (size_t i = 0; i < misses.size(); i++) {
+    uint32_t version = 0;
+    bool type_err = false;
+    miss_objs[i] =
+        GetMetaResult(exists[i], miss_keys[i], metas[i], version, type_err);
+    if (miss_objs[i] != nullptr) {
+      auto keys = GetStringFieldKeys(
+          miss_keys[i], miss_objs[i]->version,
+          DecodeFixed16(metas[i].c_str() + BASE_META_VALUE_SIZE));
+      for (size_t j = 0; j < keys.size(); j++) {
+        field_mkeys.push_back(miss_keys[i]);
+        field_keys.push_back(keys[j]);
+      }
+    }
+    begins[i + 1] = field_keys.size();
   }
+  if (field_keys.empty()) return objs;
+
+  auto values =
+      DiskSaver::Default()->GetValues(field_mkeys, field_keys, exists);
+
+  // step4, insert into memory
+  for (size_t i = 0; i < misses.size(); i++) {
+    if (miss_objs[i] == nullptr) continue;
+
+    auto obj = GetValuesResult(miss_objs[i], exists, values, begins[i],
+                               begins[i + 1]);
+    if (obj == nullptr) continue;
+
+    MemSaver::Default()->InsertObj(obj);
+    objs[misses[i]] = obj;
+  }
+
+  return objs;
+}
+
+// the disk writes go to batch when it is set, committed by its owner
+ObjPtr UpdateStringObj(BufPtr key, BufPtr value, uint8_t encode,
+                       uint32_t version, uint64_t expire, bool update_meta,
+                       DiskWriteBatch *batch = nullptr) {
+  if (update_meta) version++;
+  auto new_obj = make_object(key, value);
   new_obj->type = Type_String;
   new_obj->encode = encode;
   new_obj->version = version;
-  new_obj->value = value;
+  new_obj->expire = expire;
 
-  // step1, insert object to memory or update expire
-  if (obj == nullptr) {
-    MemSaver::Default()->InsertObj(new_obj);
-  } else if (obj->expire != expire) {
-    MemSaver::Default()->UpdateExpire(new_obj, expire);
+  // step1, insert object to memory, it replaces the cached one which may
+  // still be read by replies
+  MemSaver::Default()->InsertObj(new_obj);
+  if (update_meta && expire > 0) {
+    MemSaver::Default()->UpdateExpire(key, expire);
   }
 
   uint16_t bulk = STRING_BULK(value->len);
@@ -220,11 +313,19 @@ ObjPtr UpdateStringObj(ObjPtr obj, BufPtr key, BufPtr value, uint8_t encode,
 
   // step2, update object to rocksdb
   if (update_meta) {
-    BufPtr meta = make_buffer(BASE_META_VALUE_SIZE + STRING_META_VALUE_SIZE);
+    BufPtr meta =
+        make_buffer(BASE_META_VALUE_SIZE + STRING_META_VALUE_SIZE, Mem_Disk);
     SET_META_VALUE_HEADER(meta->data, Type_String, encode, version, expire);
     EncodeFixed16(meta->data + BASE_META_VALUE_SIZE, bulk);
 
-    DiskSaver::Default()->Set(key, meta, kvs);
+    if (batch != nullptr) {
+      batch->SetMeta(key, meta);
+      batch->SetValues(key, kvs);
+    } else {
+      DiskSaver::Default()->Set(key, meta, kvs);
+    }
+  } else if (batch != nullptr) {
+    batch->SetValues(key, kvs);
   } else {
     DiskSaver::Default()->Set(key, kvs);
   }
@@ -239,9 +340,9 @@ ObjPtr UpdateStringObj(ObjPtr obj, BufPtr key, BufPtr value, uint8_t encode,
 #define OBJ_SET_PX (1 << 3)
 
 bool SetStringForce(BufPtr key, BufPtr value, int set_flags,
-                    uint64_t expire_ms) {
+                    uint64_t expire_ms, DiskWriteBatch *batch = nullptr) {
   // step1, get object from memory
-  bool bulk = 0;
+  uint16_t bulk = 0;
   uint32_t version = 0;
   auto obj = MemSaver::Default()->GetObj(key);
   if (obj == nullptr) {
@@ -251,6 +352,8 @@ bool SetStringForce(BufPtr key, BufPtr value, int set_flags,
     obj = GetMetaResult(exist, key, meta, version, type_err);
     if (obj != nullptr)
       bulk = DecodeFixed16(meta.c_str() + BASE_META_VALUE_SIZE);
+  } else if (obj->type == Type_String) {
+    bulk = STRING_BULK(obj->value_size());
   }
 
   if ((obj != nullptr && (set_flags & OBJ_SET_NX)) ||
@@ -258,11 +361,7 @@ bool SetStringForce(BufPtr key, BufPtr value, int set_flags,
     return false;
   }
 
-  if (obj) {
-    version = obj->version;
-    if (obj->value != nullptr && obj->type == Type_String)
-      bulk = STRING_BULK(OBJ_STRING(obj)->len);
-  }
+  if (obj) version = obj->version;
 
   bool update_meta = false;
   if (obj == nullptr || obj->type != Type_String || obj->encode != Encode_Raw ||
@@ -270,7 +369,8 @@ bool SetStringForce(BufPtr key, BufPtr value, int set_flags,
     update_meta = true;
 
   // step3, udpate object to momery and rocksdb
-  UpdateStringObj(obj, key, value, Encode_Raw, version, expire_ms, update_meta);
+  UpdateStringObj(key, value, Encode_Raw, version, expire_ms, update_meta,
+                  batch);
   return true;
 }
 
@@ -287,7 +387,7 @@ void GetCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
     else if (obj == nullptr)
       return ReplyNil();
     else
-      return ReplyString(GenString(OBJ_STRING(obj), obj->encode));
+      return ReplyObj(obj);
   });
 }
 
@@ -296,6 +396,8 @@ void SetCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
   Workers::Default()->AsyncWork(cmd_args->args()[1], conn, [cmd_args]() {
     auto &args = cmd_args->args();
     static auto g_set_time_err = make_buffer("ERR invalid expire time in set");
+    if (args[2]->len > STRING_MAX_SIZE)
+      return ReplyError(g_reply_string_size_err);
 
     BufPtr expire = nullptr;
     int flags = OBJ_SET_NO_FLAGS;
@@ -355,25 +457,30 @@ void AppendCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
     uint32_t version = 0;
     bool type_err = false;
     auto &args = cmd_args->args();
+    if (args[2]->len > STRING_MAX_SIZE)
+      return ReplyError(g_reply_string_size_err);
+
     auto obj = GetStringObj(args[1], version, type_err);
     if (type_err) return ReplyTypeError();
 
     BufPtr new_value = args[2];
     if (obj != nullptr) {
-      auto str_value = GenString(OBJ_STRING(obj), obj->encode);
+      auto str_value = GenString(obj);
       size_t new_len = str_value->len + args[2]->len;
-      new_value = make_buffer(new_len, str_value);
+      if (new_len > STRING_MAX_SIZE)
+        return ReplyError(g_reply_string_size_err);
+      new_value = make_buffer(new_len, str_value, Mem_Objects);
       memcpy(new_value->data + str_value->len, args[2]->data, args[2]->len);
     }
 
     bool update_meta = false;
     if (obj == nullptr || obj->type != Type_String ||
         obj->encode != Encode_Raw ||
-        STRING_BULK(OBJ_STRING(obj)->len) != STRING_BULK(new_value->len))
+        STRING_BULK(obj->value_size()) != STRING_BULK(new_value->len))
       update_meta = true;
 
-    obj = UpdateStringObj(obj, args[1], new_value, Encode_Raw, version,
-                          obj == nullptr ? 0 : obj->expire, update_meta);
+    UpdateStringObj(args[1], new_value, Encode_Raw, version,
+                    obj == nullptr ? 0 : obj->expire, update_meta);
 
     return ReplyInteger(new_value->len);
   });
@@ -385,45 +492,47 @@ void GetSetCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
     uint32_t version = 0;
     bool type_err = false;
     auto &args = cmd_args->args();
+    if (args[2]->len > STRING_MAX_SIZE)
+      return ReplyError(g_reply_string_size_err);
+
     auto obj = GetStringObj(args[1], version, type_err);
     if (type_err) return ReplyTypeError();
 
-    BufPtr old_value = nullptr;
-    if (obj != nullptr) old_value = GenString(OBJ_STRING(obj), obj->encode);
-
     bool update_meta = false;
     if (obj == nullptr || obj->type != Type_String ||
-        obj->encode != Encode_Raw ||
-        STRING_BULK(OBJ_STRING(obj)->len) != STRING_BULK(args[2]->len))
+        obj->encode != Encode_Raw || obj->expire != 0 ||
+        STRING_BULK(obj->value_size()) != STRING_BULK(args[2]->len))
       update_meta = true;
 
-    UpdateStringObj(obj, args[1], args[2], Encode_Raw, version, 0, update_meta);
+    // the old object is not changed by the update
+    UpdateStringObj(args[1], args[2], Encode_Raw, version, 0, update_meta);
 
-    return ReplyString(old_value);
+    return ReplyObj(obj);
   });
 }
 
 void MGetCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
                  std::shared_ptr<RockinConn> conn) {
   auto &args = cmd_args->args();
-  auto rets = std::make_shared<MultiResult>(args.size() - 1);
-
-  for (size_t i = 0; i < args.size() - 1; i++) {
-    Workers::Default()->AsyncWork(
-        cmd_args->args()[1], conn, [rets, key = args[i + 1], i]() {
-          uint32_t version = 0;
-          bool type_err = false;
-          auto obj = GetStringObj(key, version, type_err);
-          if (obj != nullptr)
-            rets->str_values[i] = GenString(OBJ_STRING(obj), obj->encode);
-
-          rets->cnt.fetch_sub(1);
-          if (rets->cnt.load() == 0) {
-            return ReplyArray(rets->str_values);
-          }
-          return BufPtrs();
-        });
-  }
+  BufPtrs keys(args.begin() + 1, args.end());
+  auto values = std::make_shared<BufPtrs>(keys.size());
+
+  // each worker looks up the keys it owns, in one batch per partition
+  Workers::Default()->AsyncWork(
+      keys, conn,
+      [cmd_args, values](const std::vector<size_t> &idxs) {
+        auto &args = cmd_args->args();
+        BufPtrs keys;
+        for (size_t i = 0; i < idxs.size(); i++)
+          keys.push_back(args[idxs[i] + 1]);
+
+        auto objs = GetStringObjs(keys);
+        for (size_t i = 0; i < idxs.size(); i++) {
+          if (objs[i] == nullptr) continue;
+          (*values)[idxs[i]] = GenString(objs[i]);
+        }
+      },
+      [values]() { return ReplyArray(*values); });
 }
 
 void MSetCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
@@ -436,21 +545,37 @@ void MSetCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
     return;
   }
 
-  int cnt = args.size() / 2;
-  auto async_num = std::make_shared<std::atomic<int>>(cnt);
-
-  for (int i = 0; i < cnt; i++) {
-    Workers::Default()->AsyncWork(
-        cmd_args->args()[1], conn,
-        [async_num, key = args[i * 2 + 1], value = args[i * 2 + 2]]() {
-          SetStringForce(key, value, OBJ_SET_NO_FLAGS, 0);
-          async_num->fetch_sub(1);
-          if (async_num->load() == 0)
-            return ReplyOk();
-          else
-            return BufPtrs();
-        });
+  for (size_t i = 2; i < args.size(); i += 2) {
+    if (args[i]->len > STRING_MAX_SIZE) {
+      conn->WriteData(ReplyError(g_reply_string_size_err));
+      return;
+    }
   }
+
+  BufPtrs keys;
+  for (size_t i = 1; i < args.size(); i += 2) keys.push_back(args[i]);
+
+  // each worker sets the keys it owns and commits them in one batch per
+  // partition. the objects of a failed batch are dropped from the cache,
+  // which has them before the commit, so the next read gets rocksdb's
+  auto ok = std::make_shared<std::atomic<bool>>(true);
+  Workers::Default()->AsyncWork(
+      keys, conn,
+      [cmd_args, ok](const std::vector<size_t> &idxs) {
+        auto &args = cmd_args->args();
+        DiskWriteBatch batch;
+        for (size_t i = 0; i < idxs.size(); i++) {
+          SetStringForce(args[idxs[i] * 2 + 1], args[idxs[i] * 2 + 2],
+                         OBJ_SET_NO_FLAGS, 0, &batch);
+        }
+        if (DiskSaver::Default()->Write(batch)) return;
+
+        ok->store(false);
+        for (size_t i = 0; i < idxs.size(); i++) {
+          MemSaver::Default()->DeleteObj(args[idxs[i] * 2 + 1]);
+        }
+      },
+      [ok]() { return ok->load() ? ReplyOk() : ReplyWriteError(); });
 }
 
 static void IncrDecrProcess(std::shared_ptr<RockinConn> conn, BufPtr key,
@@ -464,25 +589,19 @@ static void IncrDecrProcess(std::shared_ptr<RockinConn> conn, BufPtr key,
     int64_t new_int = num;
     if (obj != nullptr) {
       int64_t oldv;
-      if (!GenInt64(OBJ_STRING(obj), obj->encode, oldv))
+      if (!GenInt64(obj, oldv))
         return ReplyIntegerError();
       new_int += oldv;
     }
 
-    BufPtr new_value = nullptr;
-    if (OBJ_STRING(obj)->len == sizeof(int64_t)) {
-      new_value = OBJ_STRING(obj);
-    } else {
-      new_value = make_buffer(sizeof(int64_t));
-    }
+    BufPtr new_value = make_buffer(sizeof(int64_t), Mem_Objects);
     BUF_INT64(new_value) = new_int;
 
     bool update_meta = false;
     if (obj == nullptr || obj->type != Type_String || obj->encode != Encode_Int)
       update_meta = true;
 
-    std::cout << "update_meta:" << update_meta << std::endl;
-    UpdateStringObj(obj, key, new_value, Encode_Int, version,
+    UpdateStringObj(key, new_value, Encode_Int, version,
                     obj == nullptr ? 0 : obj->expire, update_meta);
 
     return ReplyInteger(new_int);
@@ -532,22 +651,25 @@ static bool GetBitOffset(BufPtr v, int64_t &offset) {
     return false;
   }
 
-  if (offset < 0 || (offset >> 3) >= 512 * 1024 * 1024) {
+  if (offset < 0 || (offset >> 3) >= STRING_MAX_SIZE) {
     return false;
   }
 
   return true;
 }
 
+// value is copied, it may be the cached one
 static BufPtr DoSetBit(BufPtr value, int64_t offset, int on, int &ret) {
   int byte = offset >> 3;
   if (value == nullptr) {
-    value = make_buffer(byte + 1, value);
+    value = make_buffer(byte + 1, Mem_Objects);
     memset(value->data, 0, value->len);
   } else if (byte + 1 > value->len) {
     int oldlen = value->len;
-    value = make_buffer(byte + 1, value);
+    value = make_buffer(byte + 1, value, Mem_Objects);
     memset(value->data + oldlen, 0, value->len - oldlen);
+  } else {
+    value = make_buffer(value, Mem_Objects);
   }
 
   int bit = 7 - (offset & 0x7);
@@ -581,17 +703,16 @@ void SetBitCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
     if (type_err) return ReplyTypeError();
 
     int ret = 0;
-    auto value = DoSetBit(
-        obj == nullptr ? nullptr : GenString(OBJ_STRING(obj), obj->encode),
-        offset, on, ret);
+    auto value =
+        DoSetBit(obj == nullptr ? nullptr : GenString(obj), offset, on, ret);
 
     bool update_meta = false;
     if (obj == nullptr || obj->type != Type_String ||
         obj->encode != Encode_Raw ||
-        STRING_BULK(OBJ_STRING(obj)->len) != STRING_BULK(value->len))
+        STRING_BULK(obj->value_size()) != STRING_BULK(value->len))
       update_meta = true;
 
-    UpdateStringObj(obj, args[1], value, Encode_Raw, version,
+    UpdateStringObj(args[1], value, Encode_Raw, version,
                     obj != nullptr ? obj->expire : 0, update_meta);
 
     return ReplyInteger(ret);
@@ -615,7 +736,7 @@ void GetBitCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
     if (obj == nullptr) return ReplyInteger(0);
 
     int byte = offset >> 3;
-    auto str_value = GenString(OBJ_STRING(obj), obj->encode);
+    auto str_value = GenString(obj);
     if (str_value->len < byte + 1) return ReplyInteger(0);
 
     int bit = 7 - (offset & 0x7);
@@ -634,7 +755,7 @@ void BitCountCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
     if (type_err) return ReplyTypeError();
     if (obj == nullptr) return ReplyInteger(0);
 
-    auto str_value = GenString(OBJ_STRING(obj), obj->encode);
+    auto str_value = GenString(obj);
     if (args.size() == 2) {
       return ReplyInteger(BitCount(str_value->data, str_value->len));
     } else if (args.size() == 4) {
@@ -718,7 +839,16 @@ void BitopCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
         bool type_err = false;
         auto obj = GetStringObj(key, version, type_err);
         if (type_err) type_err_flag->store(true);
-        return obj;
+        if (obj == nullptr) return obj;
+
+        // values are never changed in place, a raw object is read as is
+        // in the worker of the destination key
+        if (obj->encode == Encode_Raw) return obj;
+
+        auto raw = make_object(key, GenString(obj));
+        raw->type = Type_String;
+        raw->encode = Encode_Raw;
+        return raw;
       },
       args[2],
       [key = args[2], type_err_flag, op](const ObjPtrs &objs) {
@@ -732,28 +862,24 @@ void BitopCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
         int max_len = 0;
         for (size_t i = 0; i < objs.size(); i++) {
           if (objs[i] != nullptr) {
-            int len = OBJ_STRING(objs[i])->len;
+            int len = objs[i]->value_size();
             if (len > max_len) max_len = len;
           }
         }
 
         if (max_len > 0) {
-          BufPtr new_value = nullptr;
-          if (obj != nullptr && OBJ_STRING(obj)->len == max_len)
-            new_value = OBJ_STRING(obj);
-          else
-            new_value = make_buffer(max_len);
+          BufPtr new_value = make_buffer(max_len, Mem_Objects);
 
           for (int j = 0; j < max_len; j++) {
             char output = 0;
-            if (objs[0] != nullptr && OBJ_STRING(objs[0])->len > j)
-              output = OBJ_STRING(objs[0])->data[j];
+            if (objs[0] != nullptr && objs[0]->value_size() > j)
+              output = objs[0]->value_data()[j];
 
             if (op == BITOP_NOT) output = ~output;
             for (int i = 1; i < objs.size(); i++) {
               char byte = 0;
-              if (objs[i] != nullptr && OBJ_STRING(objs[i])->len > j)
-                byte = OBJ_STRING(objs[i])->data[j];
+              if (objs[i] != nullptr && objs[i]->value_size() > j)
+                byte = objs[i]->value_data()[j];
 
               switch (op) {
                 case BITOP_AND:
@@ -773,9 +899,9 @@ void BitopCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
           bool update_meta = false;
           if (obj == nullptr || obj->type != Type_String ||
               obj->encode != Encode_Raw || obj->expire != 0 ||
-              STRING_BULK(OBJ_STRING(obj)->len) != STRING_BULK(max_len))
+              STRING_BULK(obj->value_size()) != STRING_BULK(max_len))
             update_meta = true;
-          UpdateStringObj(obj, key, new_value, Encode_Raw, version, 0,
+          UpdateStringObj(key, new_value, Encode_Raw, version, 0,
                           update_meta);
         }
 
@@ -799,7 +925,7 @@ void BitPosCmd::Do(std::shared_ptr<CmdArgs> cmd_args,
     else if (obj == nullptr)
       return ReplyInteger(bit ? -1 : 0);
 
-    auto str_value = GenString(OBJ_STRING(obj), obj->encode);
+    auto str_value = GenString(obj);
     bool end_given = false;
     int64_t start, end;
     if (args.size() == 4 || args.size() == 5) {
@@ -861,10 +987,10 @@ void StringDebug::Do(std::shared_ptr<CmdArgs> cmd_args,
              make_buffer(Format("version:%u", obj->version)));
          values.push_back(
              make_buffer(Format("expire:%llu", obj->expire)));
-         std::string key(obj->key->data, obj->key->len);
+         std::string key(obj->key_data(), obj->key_len);
          values.push_back(make_buffer(
              Format("key[%d]:%s", key.length(), key.c_str())));
-         std::string value(OBJ_STRING(obj)->data, OBJ_STRING(obj)->len);
+         std::string value(obj->value_data(), obj->value_size());
          values.push_back(make_buffer(
              Format("value[%d]:%s", value.length(), value.c_str())));
 
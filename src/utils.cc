@@ -8,6 +8,10 @@
 #include <random>
 #include <sstream>
 #include "dirent.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STRCHR_SIMD 1
+#endif
 
 namespace rockin {
 
@@ -113,6 +117,152 @@ bool SetNoDelay(int sock) {
   return true;
 }
 
+static char *StrchrScalar(char *s, size_t l, char c) {
+  for (size_t i = 0; i < l; ++i) {
+    if (s[i] == c) return s + i;
+  }
+  return nullptr;
+}
+
+static char *Strchr2Scalar(char *s, size_t l, char c1, char c2) {
+  for (size_t i = 1; i < l; ++i) {
+    if (s[i - 1] == c1 && s[i] == c2) return s + (i - 1);
+  }
+  return nullptr;
+}
+
+static uint64_t CharMask64Scalar(const char *s, char c) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; ++i) {
+    if (s[i] == c) mask |= 1ULL << i;
+  }
+  return mask;
+}
+
+#ifdef STRCHR_SIMD
+static uint64_t CharMask64SSE2(const char *s, char c) {
+  const __m128i vc = _mm_set1_epi8(c);
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)) << i;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) static uint64_t CharMask64AVX2(const char *s,
+                                                               char c) {
+  const __m256i vc = _mm256_set1_epi8(c);
+  __m256i lo = _mm256_loadu_si256((const __m256i *)s);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(s + 32));
+  uint32_t lo_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vc));
+  uint32_t hi_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vc));
+  return ((uint64_t)hi_mask << 32) | lo_mask;
+}
+
+static char *StrchrSSE2(char *s, size_t l, char c) {
+  const __m128i vc = _mm_set1_epi8(c);
+  size_t i = 0;
+  for (; i + 16 <= l; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vc));
+    if (mask) return s + i + __builtin_ctz(mask);
+  }
+  return StrchrScalar(s + i, l - i, c);
+}
+
+// compare s[i] with c1 and s[i+1] with c2 for 16 positions at once
+static char *Strchr2SSE2(char *s, size_t l, char c1, char c2) {
+  const __m128i v1 = _mm_set1_epi8(c1);
+  const __m128i v2 = _mm_set1_epi8(c2);
+  size_t i = 0;
+  for (; i + 17 <= l; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 1));
+    int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, v1), _mm_cmpeq_epi8(b, v2)));
+    if (mask) return s + i + __builtin_ctz(mask);
+  }
+  return Strchr2Scalar(s + i, l - i, c1, c2);
+}
+
+__attribute__((target("avx2"))) static char *StrchrAVX2(char *s, size_t l,
+                                                        char c) {
+  const __m256i vc = _mm256_set1_epi8(c);
+  size_t i = 0;
+  for (; i + 32 <= l; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vc));
+    if (mask) return s + i + __builtin_ctz(mask);
+  }
+  return StrchrSSE2(s + i, l - i, c);
+}
+
+__attribute__((target("avx2"))) static char *Strchr2AVX2(char *s, size_t l,
+                                                         char c1, char c2) {
+  const __m256i v1 = _mm256_set1_epi8(c1);
+  const __m256i v2 = _mm256_set1_epi8(c2);
+  size_t i = 0;
+  for (; i + 33 <= l; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + 1));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, v1), _mm256_cmpeq_epi8(b, v2)));
+    if (mask) return s + i + __builtin_ctz(mask);
+  }
+  return Strchr2SSE2(s + i, l - i, c1, c2);
+}
+#endif
+
+namespace {
+typedef char *(*StrchrFunc)(char *, size_t, char);
+typedef char *(*Strchr2Func)(char *, size_t, char, char);
+typedef uint64_t (*CharMask64Func)(const char *, char);
+
+struct StrchrTable {
+  const char *impl;
+  StrchrFunc strchr;
+  Strchr2Func strchr2;
+  CharMask64Func mask64;
+
+  StrchrTable()
+      : impl("scalar"),
+        strchr(StrchrScalar),
+        strchr2(Strchr2Scalar),
+        mask64(CharMask64Scalar) {
+#ifdef STRCHR_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      impl = "avx2", strchr = StrchrAVX2, strchr2 = Strchr2AVX2;
+      mask64 = CharMask64AVX2;
+    } else {
+      impl = "sse2", strchr = StrchrSSE2, strchr2 = Strchr2SSE2;
+      mask64 = CharMask64SSE2;
+    }
+#endif
+  }
+};
+
+const StrchrTable &GetStrchrTable() {
+  static StrchrTable table;
+  return table;
+}
+};  // namespace
+
+char *StrchrVec(char *s, size_t l, char c) {
+  return GetStrchrTable().strchr(s, l, c);
+}
+
+char *Strchr2Vec(char *s, size_t l, char c1, char c2) {
+  return GetStrchrTable().strchr2(s, l, c1, c2);
+}
+
+uint64_t CharMask64(const char *s, char c) {
+  return GetStrchrTable().mask64(s, c);
+}
+
+const char *StrchrImpl() { return GetStrchrTable().impl; }
+
 int Int64ToString(char *s, size_t len, int64_t value) {
   char buf[32], *p;
   unsigned long long v;
@@ -1,15 +1,31 @@
 #include "workers.h"
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <algorithm>
 #include <mutex>
 #include <sstream>
 #include "cmd_args.h"
+#include "cmd_reply.h"
 #include "mem_saver.h"
 #include "rockin_conn.h"
 #include "siphash.h"
 #include "type_control.h"
 #include "type_string.h"
 
+// commands waiting for one worker, more are refused instead of stalling the
+// event loop
+#define WORKER_QUEUE_SIZE (1024 * 16)
+
+// finished works kept by a busy worker before they are handed to the loops
+#define WORKER_DONE_BATCH 64
+
+DEFINE_int32(expire_cycle_ms, 10,
+             "interval of the active expire cycle of each worker, which "
+             "deletes keys whose expire time passed");
+DEFINE_int32(expire_cycle_keys, 128,
+             "max expired keys a worker deletes in one cycle, the others "
+             "wait for the next cycles");
+
 namespace rockin {
 
 namespace {
@@ -23,6 +39,14 @@ Workers *Workers::Default() {
 }
 
 bool Workers::Init(size_t thread_num) {
+  // a cycle of 0 ms would park an idle worker for good, and 0 keys would
+  // never expire one
+  if (FLAGS_expire_cycle_ms < 1 || FLAGS_expire_cycle_keys < 1) {
+    LOG(FATAL) << "expire_cycle_ms:" << FLAGS_expire_cycle_ms
+               << " and expire_cycle_keys:" << FLAGS_expire_cycle_keys
+               << " must be at least 1";
+  }
+
   // COMMAND
   auto command_ptr = std::make_shared<CommandCmd>(CmdInfo("command", 1));
   cmd_table_.insert(std::make_pair("command", command_ptr));
@@ -36,35 +60,43 @@ bool Workers::Init(size_t thread_num) {
   cmd_table_.insert(std::make_pair("info", info_ptr));
 
   // DEL key1 [key2]...
-  auto del_ptr = std::make_shared<DelCmd>(CmdInfo("del", -2));
+  auto del_ptr = std::make_shared<DelCmd>(CmdInfo("del", -2, 1, -1, 1));
   cmd_table_.insert(std::make_pair("del", del_ptr));
 
+  // UNLINK key1 [key2]..., the same as DEL, whose cost does not grow with
+  // the values
+  auto unlink_ptr = std::make_shared<DelCmd>(CmdInfo("unlink", -2, 1, -1, 1));
+  cmd_table_.insert(std::make_pair("unlink", unlink_ptr));
+
   // SELECT dbnum
   auto select_ptr = std::make_shared<SelectCmd>(CmdInfo("select", 2));
   cmd_table_.insert(std::make_pair("select", select_ptr));
 
   // TTL key
-  auto ttl_ptr = std::make_shared<TTLCmd>(CmdInfo("ttl", 2));
+  auto ttl_ptr = std::make_shared<TTLCmd>(CmdInfo("ttl", 2, 1, 1, 1));
   cmd_table_.insert(std::make_pair("ttl", ttl_ptr));
 
   // PTTL key
-  auto pttl_ptr = std::make_shared<PTTLCmd>(CmdInfo("pttl", 2));
+  auto pttl_ptr = std::make_shared<PTTLCmd>(CmdInfo("pttl", 2, 1, 1, 1));
   cmd_table_.insert(std::make_pair("pttl", pttl_ptr));
 
   // EXPIRE key seconds
-  auto expire_ptr = std::make_shared<ExpireCmd>(CmdInfo("expire", 3));
+  auto expire_ptr = std::make_shared<ExpireCmd>(CmdInfo("expire", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("expire", expire_ptr));
 
   // PEXPIRE key milliseconds
-  auto pexpire_ptr = std::make_shared<PExpireCmd>(CmdInfo("pexpire", 3));
+  auto pexpire_ptr =
+      std::make_shared<PExpireCmd>(CmdInfo("pexpire", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("pexpire", pexpire_ptr));
 
   // EXPIREAT key timestamp
-  auto expireat_ptr = std::make_shared<ExpireAtCmd>(CmdInfo("expireat", 3));
+  auto expireat_ptr =
+      std::make_shared<ExpireAtCmd>(CmdInfo("expireat", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("expireat", expireat_ptr));
 
   // PEXPIREAT key millisecond-timestam
-  auto pexpireat_ptr = std::make_shared<PExpireAtCmd>(CmdInfo("pexpireat", 3));
+  auto pexpireat_ptr =
+      std::make_shared<PExpireAtCmd>(CmdInfo("pexpireat", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("pexpireat", pexpireat_ptr));
 
   // FLUSHDB
@@ -80,98 +112,173 @@ bool Workers::Init(size_t thread_num) {
   cmd_table_.insert(std::make_pair("compact", compact_ptr));
 
   // GET key
-  auto get_ptr = std::make_shared<GetCmd>(CmdInfo("get", 2));
+  auto get_ptr = std::make_shared<GetCmd>(CmdInfo("get", 2, 1, 1, 1));
   cmd_table_.insert(std::make_pair("get", get_ptr));
 
-  auto set_ptr = std::make_shared<SetCmd>(CmdInfo("set", -3));
+  auto set_ptr = std::make_shared<SetCmd>(CmdInfo("set", -3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("set", set_ptr));
 
   // APPEND key value
-  auto append_ptr = std::make_shared<AppendCmd>(CmdInfo("append", 3));
+  auto append_ptr = std::make_shared<AppendCmd>(CmdInfo("append", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("append", append_ptr));
 
   // GETSET key value
-  auto getset_ptr = std::make_shared<GetSetCmd>(CmdInfo("getset", 3));
+  auto getset_ptr = std::make_shared<GetSetCmd>(CmdInfo("getset", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("getset", getset_ptr));
 
   // MGET key1 [key2]...
-  auto mget_ptr = std::make_shared<MGetCmd>(CmdInfo("mget", -2));
+  auto mget_ptr = std::make_shared<MGetCmd>(CmdInfo("mget", -2, 1, -1, 1));
   cmd_table_.insert(std::make_pair("mget", mget_ptr));
 
   // MSET key1 value1 [kye2 value2]...
-  auto mset_ptr = std::make_shared<MSetCmd>(CmdInfo("mset", -3));
+  auto mset_ptr = std::make_shared<MSetCmd>(CmdInfo("mset", -3, 1, -1, 2));
   cmd_table_.insert(std::make_pair("mset", mset_ptr));
 
   // INCR key
-  auto incr_ptr = std::make_shared<IncrCmd>(CmdInfo("incr", 2));
+  auto incr_ptr = std::make_shared<IncrCmd>(CmdInfo("incr", 2, 1, 1, 1));
   cmd_table_.insert(std::make_pair("incr", incr_ptr));
 
   // INCRBY key value
-  auto incrby_ptr = std::make_shared<IncrbyCmd>(CmdInfo("incrby", 3));
+  auto incrby_ptr = std::make_shared<IncrbyCmd>(CmdInfo("incrby", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("incrby", incrby_ptr));
 
   // DECR key
-  auto decr_ptr = std::make_shared<DecrCmd>(CmdInfo("decr", 2));
+  auto decr_ptr = std::make_shared<DecrCmd>(CmdInfo("decr", 2, 1, 1, 1));
   cmd_table_.insert(std::make_pair("decr", decr_ptr));
 
   // DECR key value
-  auto decrby_ptr = std::make_shared<DecrbyCmd>(CmdInfo("decrby", 3));
+  auto decrby_ptr = std::make_shared<DecrbyCmd>(CmdInfo("decrby", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("decrby", decrby_ptr));
 
   // SETBIT key offset value
-  auto setbit_ptr = std::make_shared<SetBitCmd>(CmdInfo("setbit", 4));
+  auto setbit_ptr = std::make_shared<SetBitCmd>(CmdInfo("setbit", 4, 1, 1, 1));
   cmd_table_.insert(std::make_pair("setbit", setbit_ptr));
 
   // GETBIT key offset
-  auto getbit_ptr = std::make_shared<GetBitCmd>(CmdInfo("getbit", 3));
+  auto getbit_ptr = std::make_shared<GetBitCmd>(CmdInfo("getbit", 3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("getbit", getbit_ptr));
 
   // BITCOUNT key [start end]
-  auto bitcount_ptr = std::make_shared<BitCountCmd>(CmdInfo("bitcount", -2));
+  auto bitcount_ptr =
+      std::make_shared<BitCountCmd>(CmdInfo("bitcount", -2, 1, 1, 1));
   cmd_table_.insert(std::make_pair("bitcount", bitcount_ptr));
 
   // BITOP AND destkey srckey1 srckey2 srckey3 ... srckeyN
   // BITOP OR destkey srckey1 srckey2 srckey3... srckeyN
   // BITOP XOR destkey srckey1 srckey2 srckey3... srckeyN
   // BITOP NOT destkey srckey
-  auto bitop_ptr = std::make_shared<BitopCmd>(CmdInfo("bitop", -4));
+  auto bitop_ptr = std::make_shared<BitopCmd>(CmdInfo("bitop", -4, 2, -1, 1));
   cmd_table_.insert(std::make_pair("bitop", bitop_ptr));
 
   // BITPOS key bit[start][end]
-  auto bitpos_ptr = std::make_shared<BitPosCmd>(CmdInfo("bitpos", -3));
+  auto bitpos_ptr = std::make_shared<BitPosCmd>(CmdInfo("bitpos", -3, 1, 1, 1));
   cmd_table_.insert(std::make_pair("bitpos", bitpos_ptr));
 
   // STRINGDEBUG key
-  auto strdebug_ptr = std::make_shared<StringDebug>(CmdInfo("strdebug", 2));
+  auto strdebug_ptr =
+      std::make_shared<StringDebug>(CmdInfo("strdebug", 2, 1, 1, 1));
   cmd_table_.insert(std::make_pair("strdebug", strdebug_ptr));
 
   thread_num_ = thread_num;
   for (size_t i = 0; i < thread_num; i++)
-    asyncs_.push_back(new AsyncQueue(1000));
+    asyncs_.push_back(new AsyncQueue(WORKER_QUEUE_SIZE));
   return this->InitAsync(thread_num);
 }
 
+// finished works of one event loop, handed over under one lock with one
+// wakeup
+struct LoopDone {
+  uv_loop_t *loop;
+  std::vector<uv__work *> works;
+};
+
+static void FlushDone(std::vector<LoopDone> &dones) {
+  for (size_t i = 0; i < dones.size(); i++) {
+    LoopDone &done = dones[i];
+    if (done.works.empty()) continue;
+
+    uv_mutex_lock(&done.loop->wq_mutex);
+    for (size_t j = 0; j < done.works.size(); j++) {
+      uv__work *w = done.works[j];
+      w->work = NULL;
+      QUEUE_INSERT_TAIL(&done.loop->wq, &w->wq);
+    }
+    uv_async_send(&done.loop->wq_async);
+    uv_mutex_unlock(&done.loop->wq_mutex);
+    done.works.clear();
+  }
+}
+
 void Workers::AsyncWork(int idx) {
-  MemSaver::Default()->Init();
+  MemSaver::Default()->Init(idx, thread_num_);
 
   AsyncQueue *async = asyncs_[idx];
+  std::vector<LoopDone> dones;
+  size_t done_count = 0;
+  uint64_t next_expire = GetMilliSec() + FLAGS_expire_cycle_ms;
   while (true) {
-    QUEUE *q = async->Pop();
+    QUEUE *q = async->TryPop();
+    if (q == nullptr) {
+      // nothing queued, deliver before waiting
+      FlushDone(dones);
+      done_count = 0;
+
+      // an idle worker wakes up for the expire cycle
+      uint64_t now = GetMilliSec();
+      if (now >= next_expire) {
+        ActiveExpire(now, FLAGS_expire_cycle_keys);
+        next_expire = now + FLAGS_expire_cycle_ms;
+      }
+      q = async->Pop(next_expire - now);
+      if (q == nullptr) continue;
+    }
+
     uv__work *w = QUEUE_DATA(q, struct uv__work, wq);
     w->work(w);
 
     // async done
-    uv_mutex_lock(&w->loop->wq_mutex);
-    w->work = NULL;
-    QUEUE_INSERT_TAIL(&w->loop->wq, &w->wq);
-    uv_async_send(&w->loop->wq_async);
-    uv_mutex_unlock(&w->loop->wq_mutex);
+    size_t i = 0;
+    while (i < dones.size() && dones[i].loop != w->loop) i++;
+    if (i == dones.size()) dones.push_back(LoopDone{w->loop, {}});
+    dones[i].works.push_back(w);
+
+    if (++done_count >= WORKER_DONE_BATCH) {
+      FlushDone(dones);
+      done_count = 0;
+
+      // a busy worker runs the cycle between batches
+      uint64_t now = GetMilliSec();
+      if (now >= next_expire) {
+        ActiveExpire(now, FLAGS_expire_cycle_keys);
+        next_expire = now + FLAGS_expire_cycle_ms;
+      }
+    }
   }
 }
 
-void Workers::PostWork(int idx, QUEUE *q) {
+bool Workers::PostWork(int idx, QUEUE *q, bool wait) {
   AsyncQueue *async = asyncs_[idx];
+  if (!wait) return async->TryPush(q);
   async->Push(q);
+  return true;
+}
+
+static void ReplyBusy(std::shared_ptr<RockinConn> conn, uint64_t seq) {
+  static BufPtr g_reply_busy =
+      make_buffer("ERR server is busy, worker queue is full");
+  conn->WriteData(seq, ReplyError(g_reply_busy));
+}
+
+// the keys of a command become db keys of the db of the connection before
+// it runs, nothing after sees a key without its db
+static void ToDBKeys(int db, const CmdInfo &info, BufPtrs &args) {
+  int last = info.last_key < 0 ? (int)args.size() + info.last_key
+                               : info.last_key;
+  for (int i = info.first_key; i <= last; i += info.key_step) {
+    BufPtr key = make_buffer(DB_KEY_SIZE(args[i]->len), Mem_Args);
+    SET_DB_KEY(key->data, db, args[i]->data, args[i]->len);
+    args[i] = key;
+  }
 }
 
 void Workers::HandeCmd(std::shared_ptr<RockinConn> conn,
@@ -186,7 +293,8 @@ void Workers::HandeCmd(std::shared_ptr<RockinConn> conn,
   if (iter == cmd_table_.end()) {
     std::ostringstream build;
     build << "ERR unknown command `" << cmd << "`, with args beginning with: ";
-    for (int i = 1; i < args.size(); i++) build << "`" << args[i] << "`, ";
+    for (int i = 1; i < args.size(); i++)
+      build << "`" << std::string(args[i]->data, args[i]->len) << "`, ";
     conn->ReplyError(make_buffer(build.str()));
     return;
   }
@@ -200,44 +308,60 @@ void Workers::HandeCmd(std::shared_ptr<RockinConn> conn,
     return;
   }
 
+  const CmdInfo &info = iter->second->info();
+  if (info.first_key > 0) ToDBKeys(conn->index(), info, args);
   iter->second->Do(cmd_args, conn);
 }
 
 struct WorkHelper {
   std::shared_ptr<RockinConn> conn;
+  uint64_t seq;
   std::function<BufPtrs()> handle;
   BufPtrs result;
 };
 
 void Workers::AsyncWork(BufPtr mkey, std::shared_ptr<RockinConn> conn,
                         std::function<BufPtrs()> handle) {
+  uint64_t seq = conn->cur_seq();
   WorkHelper *helper = new WorkHelper();
   helper->conn = conn;
+  helper->seq = seq;
   helper->handle = handle;
 
   uv_work_t *req = (uv_work_t *)malloc(sizeof(uv_work_t));
   req->data = helper;
 
-  this->AsyncQueueWork(rockin::Hash(mkey->data, mkey->len) % thread_num_,
-                       conn->loop(), req,
-                       [](uv_work_t *req) {
-                         WorkHelper *helper = (WorkHelper *)req->data;
-                         helper->result = helper->handle();
-                       },
-                       [](uv_work_t *req, int status) {
-                         WorkHelper *helper = (WorkHelper *)req->data;
-                         if (helper->result.size() > 0)
-                           helper->conn->WriteData(std::move(helper->result));
-                         delete helper;
-                         free(req);
-                       });
+  int ret = this->AsyncQueueWork(
+      rockin::Hash(mkey->data, mkey->len) % thread_num_, conn->loop(), req,
+      [](uv_work_t *req) {
+        WorkHelper *helper = (WorkHelper *)req->data;
+        helper->result = helper->handle();
+      },
+      [](uv_work_t *req, int status) {
+        WorkHelper *helper = (WorkHelper *)req->data;
+        if (helper->result.size() > 0)
+          helper->conn->WriteData(helper->seq, std::move(helper->result));
+        helper->conn->ReleaseReply(helper->seq);
+        delete helper;
+        free(req);
+      });
+
+  if (ret != 0) {
+    delete helper;
+    free(req);
+    if (ret == UV_EBUSY) ReplyBusy(conn, seq);
+    return;
+  }
+  conn->HoldReply(seq);
 }
 
 struct MultiWorkData {
   std::shared_ptr<RockinConn> conn;
   std::function<ObjPtr(BufPtr)> mid_handle;
   std::function<BufPtrs(const ObjPtrs &)> handle;
+  uint64_t seq;
   std::atomic<int> count;
+  int error;
   BufPtrs mkeys;
   BufPtr key;
   ObjPtrs objs;
@@ -254,13 +378,18 @@ void Workers::AsyncWork(BufPtrs mkeys, std::shared_ptr<RockinConn> conn,
                         std::function<BufPtrs(const ObjPtrs &)> handle) {
   auto data = std::make_shared<MultiWorkData>();
   data->conn = conn;
+  data->seq = conn->cur_seq();
   data->mid_handle = mid_handle;
   data->handle = handle;
   data->count = mkeys.size();
+  data->error = 0;
   data->mkeys = mkeys;
   data->key = key;
   data->objs = ObjPtrs(mkeys.size());
 
+  // released when the handle is done
+  conn->HoldReply(data->seq);
+
   for (size_t i = 0; i < mkeys.size(); i++) {
     uv_work_t *req = (uv_work_t *)malloc(sizeof(uv_work_t));
     MultiWorkHelper *helper = new MultiWorkHelper();
@@ -269,7 +398,7 @@ void Workers::AsyncWork(BufPtrs mkeys, std::shared_ptr<RockinConn> conn,
     req->data = helper;
 
     auto key = mkeys[i];
-    this->AsyncQueueWork(
+    int ret = this->AsyncQueueWork(
         rockin::Hash(key->data, key->len) % thread_num_, conn->loop(), req,
         [](uv_work_t *req) {
           MultiWorkHelper *helper = (MultiWorkHelper *)req->data;
@@ -282,32 +411,158 @@ void Workers::AsyncWork(BufPtrs mkeys, std::shared_ptr<RockinConn> conn,
           delete helper;
           free(req);
 
-          data->count--;
-          if (data->count == 0) {
-            uv_work_t *req = (uv_work_t *)malloc(sizeof(uv_work_t));
-            MultiWorkHelper *helper = new MultiWorkHelper();
-            helper->data = data;
-            req->data = helper;
-
-            Workers::Default()->AsyncQueueWork(
-                rockin::Hash(data->key->data, data->key->len) %
-                    Workers::Default()->thread_num_,
-                data->conn->loop(), req,
-                [](uv_work_t *req) {
-                  MultiWorkHelper *helper = (MultiWorkHelper *)req->data;
-                  helper->data->result =
-                      helper->data->handle(helper->data->objs);
-                },
-                [](uv_work_t *req, int status) {
-                  MultiWorkHelper *helper = (MultiWorkHelper *)req->data;
-                  if (helper->data->result.size() > 0)
-                    helper->data->conn->WriteData(
-                        std::move(helper->data->result));
-                  delete helper;
-                  free(req);
-                });
-          }
+          if (--data->count == 0) Workers::Default()->MultiWorkDone(data);
         });
+
+    if (ret != 0) {
+      // the keys left are not queued, finish with the ones already queued
+      delete helper;
+      free(req);
+      data->error = ret;
+      if ((data->count -= int(mkeys.size() - i)) == 0) MultiWorkDone(data);
+      break;
+    }
+  }
+}
+
+void Workers::MultiWorkDone(std::shared_ptr<MultiWorkData> data) {
+  if (data->error != 0) {
+    if (data->error == UV_EBUSY) ReplyBusy(data->conn, data->seq);
+    data->conn->ReleaseReply(data->seq);
+    return;
+  }
+
+  uv_work_t *req = (uv_work_t *)malloc(sizeof(uv_work_t));
+  MultiWorkHelper *helper = new MultiWorkHelper();
+  helper->data = data;
+  req->data = helper;
+
+  int ret = this->AsyncQueueWork(
+      rockin::Hash(data->key->data, data->key->len) % thread_num_,
+      data->conn->loop(), req,
+      [](uv_work_t *req) {
+        MultiWorkHelper *helper = (MultiWorkHelper *)req->data;
+        helper->data->result = helper->data->handle(helper->data->objs);
+      },
+      [](uv_work_t *req, int status) {
+        MultiWorkHelper *helper = (MultiWorkHelper *)req->data;
+        auto data = helper->data;
+        if (data->result.size() > 0)
+          data->conn->WriteData(data->seq, std::move(data->result));
+        data->conn->ReleaseReply(data->seq);
+        delete helper;
+        free(req);
+      });
+
+  if (ret != 0) {
+    delete helper;
+    free(req);
+    if (ret == UV_EBUSY) ReplyBusy(data->conn, data->seq);
+    data->conn->ReleaseReply(data->seq);
+  }
+}
+
+struct GroupWorkData {
+  std::shared_ptr<RockinConn> conn;
+  uint64_t seq;
+  std::function<void(const std::vector<size_t> &)> group_handle;
+  std::function<BufPtrs()> handle;
+  int count;
+  int error;
+};
+
+struct GroupWorkHelper {
+  std::vector<size_t> idxs;
+  std::shared_ptr<GroupWorkData> data;
+};
+
+static void GroupWorkDone(std::shared_ptr<GroupWorkData> data) {
+  if (data->error != 0) {
+    if (data->error == UV_EBUSY) ReplyBusy(data->conn, data->seq);
+  } else {
+    BufPtrs result = data->handle();
+    if (result.size() > 0) data->conn->WriteData(data->seq, std::move(result));
+  }
+  data->conn->ReleaseReply(data->seq);
+}
+
+void Workers::AsyncWork(
+    const BufPtrs &keys, std::shared_ptr<RockinConn> conn,
+    std::function<void(const std::vector<size_t> &)> group_handle,
+    std::function<BufPtrs()> handle) {
+  std::vector<std::vector<size_t>> groups(thread_num_);
+  for (size_t i = 0; i < keys.size(); i++) {
+    groups[rockin::Hash(keys[i]->data, keys[i]->len) % thread_num_].push_back(
+        i);
+  }
+  AsyncGroups(groups, false, conn, group_handle, handle);
+}
+
+void Workers::AsyncWorkAll(std::shared_ptr<RockinConn> conn,
+                           std::function<void()> worker_handle,
+                           std::function<BufPtrs()> handle) {
+  std::vector<std::vector<size_t>> groups(thread_num_);
+  AsyncGroups(groups, true, conn,
+              [worker_handle](const std::vector<size_t> &) { worker_handle(); },
+              handle);
+}
+
+void Workers::AsyncGroups(
+    std::vector<std::vector<size_t>> &groups, bool all,
+    std::shared_ptr<RockinConn> conn,
+    std::function<void(const std::vector<size_t> &)> group_handle,
+    std::function<BufPtrs()> handle) {
+  // count is only touched in the loop thread
+  auto data = std::make_shared<GroupWorkData>();
+  data->conn = conn;
+  data->seq = conn->cur_seq();
+  data->group_handle = group_handle;
+  data->handle = handle;
+  data->count = 0;
+  data->error = 0;
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (all || !groups[i].empty()) data->count++;
+  }
+
+  // released when the reply is built
+  conn->HoldReply(data->seq);
+  if (data->count == 0) return GroupWorkDone(data);
+
+  int left = data->count;
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (!all && groups[i].empty()) continue;
+
+    uv_work_t *req = (uv_work_t *)malloc(sizeof(uv_work_t));
+    GroupWorkHelper *helper = new GroupWorkHelper();
+    helper->idxs = std::move(groups[i]);
+    helper->data = data;
+    req->data = helper;
+
+    int ret = this->AsyncQueueWork(
+        i, conn->loop(), req,
+        [](uv_work_t *req) {
+          GroupWorkHelper *helper = (GroupWorkHelper *)req->data;
+          helper->data->group_handle(helper->idxs);
+        },
+        [](uv_work_t *req, int status) {
+          GroupWorkHelper *helper = (GroupWorkHelper *)req->data;
+          auto data = helper->data;
+          delete helper;
+          free(req);
+
+          if (--data->count == 0) GroupWorkDone(data);
+        },
+        all);
+
+    if (ret != 0) {
+      // the groups left are not queued, finish with the ones already queued
+      delete helper;
+      free(req);
+      data->error = ret;
+      if ((data->count -= left) == 0) GroupWorkDone(data);
+      break;
+    }
+    left--;
   }
 }
 
@@ -0,0 +1,70 @@
+// appends past the chunk of a ByteBuf, as the replies of a pipeline fill
+// the output buffer of a connection
+// make test
+#include <assert.h>
+#include <stdio.h>
+#include <string>
+#include "byte_buf.h"
+
+using namespace rockin;
+
+#define TEST_CHUNK_SIZE (16 * 1024)
+
+// blocks of 1000 bytes, the chunk runs out after 16
+static void AppendBlocks(ByteBuf &buf, size_t blocks, std::string &expect) {
+  for (size_t i = 0; i < blocks; i++) {
+    std::string block(1000, 'a' + i % 26);
+    buf.append(block.data(), block.length());
+    expect += block;
+  }
+}
+
+static void TestAppendPastChunk() {
+  ByteBuf buf(TEST_CHUNK_SIZE);
+  std::string expect;
+  AppendBlocks(buf, 100, expect);
+  assert(buf.readable() == expect.length());
+  assert(memcmp(buf.readptr(), expect.data(), expect.length()) == 0);
+}
+
+// one append larger than the chunk
+static void TestAppendLarge() {
+  ByteBuf buf(TEST_CHUNK_SIZE);
+  std::string small(10 * 1024, 's'), large(100 * 1024, 'l');
+  buf.append(small.data(), small.length());
+  buf.append(large.data(), large.length());
+  assert(buf.readable() == small.length() + large.length());
+  assert(memcmp(buf.readptr() + small.length(), large.data(),
+                large.length()) == 0);
+}
+
+// a partly read chunk is compacted only when the append then fits
+static void TestAppendAfterRead() {
+  ByteBuf buf(TEST_CHUNK_SIZE);
+  std::string expect;
+  AppendBlocks(buf, 12, expect);
+  buf.move_readptr(10000);
+  expect.erase(0, 10000);
+  AppendBlocks(buf, 20, expect);
+  assert(buf.readable() == expect.length());
+  assert(memcmp(buf.readptr(), expect.data(), expect.length()) == 0);
+}
+
+// the pooled chunk of a connection
+static void TestAppendPooled() {
+  ChunkPool pool(TEST_CHUNK_SIZE, 4);
+  ByteBuf buf(&pool);
+  std::string expect;
+  AppendBlocks(buf, 40, expect);
+  assert(buf.readable() == expect.length());
+  assert(memcmp(buf.readptr(), expect.data(), expect.length()) == 0);
+}
+
+int main() {
+  TestAppendPastChunk();
+  TestAppendLarge();
+  TestAppendAfterRead();
+  TestAppendPooled();
+  printf("byte_buf_test ok\n");
+  return 0;
+}
@@ -0,0 +1,130 @@
+// a client pipelines SETs of keys of every worker, a FLUSHDB and GETs of
+// the same keys, no key set before the flush may be read after it
+// make test
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include "disk_saver.h"
+#include "rockin_server.h"
+#include "utils.h"
+#include "workers.h"
+
+using namespace rockin;
+
+#define TEST_PORT 9100
+#define TEST_PATH "/tmp/rockin_flush_test"
+#define TEST_KEYS 64
+#define TEST_ROUNDS 200
+
+static std::string Command(const std::string &a, const std::string &b = "",
+                           const std::string &c = "") {
+  std::string args[] = {a, b, c};
+  int n = c.empty() ? (b.empty() ? 1 : 2) : 3;
+  std::string cmd = Format("*%d\r\n", n);
+  for (int i = 0; i < n; i++) {
+    cmd += Format("$%d\r\n", (int)args[i].length()) + args[i] + "\r\n";
+  }
+  return cmd;
+}
+
+// a reply line by line, a bulk is its header and its data
+class Replies {
+ public:
+  explicit Replies(int fd) : fd_(fd) {}
+
+  std::string Next() {
+    std::string line = Line();
+    if (line[0] == '$' && line != "$-1") line += "|" + Line();
+    return line;
+  }
+
+ private:
+  std::string Line() {
+    size_t pos;
+    while ((pos = buf_.find("\r\n")) == std::string::npos) {
+      char data[4096];
+      ssize_t n = read(fd_, data, sizeof(data));
+      assert(n > 0);
+      buf_.append(data, n);
+    }
+    std::string line = buf_.substr(0, pos);
+    buf_.erase(0, pos + 2);
+    return line;
+  }
+
+  int fd_;
+  std::string buf_;
+};
+
+static int Connect() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(TEST_PORT);
+  int ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+  assert(ret == 0);
+  return fd;
+}
+
+static void WriteAll(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.length()) {
+    ssize_t n = write(fd, data.data() + sent, data.length() - sent);
+    assert(n > 0);
+    sent += n;
+  }
+}
+
+static void TestSetFlushGet(int fd, Replies &replies, int round) {
+  std::string value = Format("v%d", round);
+  std::string pipeline;
+  for (int i = 0; i < TEST_KEYS; i++) {
+    pipeline += Command("set", Format("key:%d", i), value);
+  }
+  pipeline += Command("flushdb");
+  for (int i = 0; i < TEST_KEYS; i++) {
+    pipeline += Command("get", Format("key:%d", i));
+  }
+  WriteAll(fd, pipeline);
+
+  for (int i = 0; i < TEST_KEYS; i++) assert(replies.Next() == "+OK");
+  assert(replies.Next() == "+OK");
+  for (int i = 0; i < TEST_KEYS; i++) {
+    std::string reply = replies.Next();
+    if (reply != "$-1") {
+      fprintf(stderr, "round %d key:%d read %s after the flush\n", round, i,
+              reply.c_str());
+      exit(1);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  system("rm -rf " TEST_PATH);
+  bool ok = DiskSaver::Default()->Init(1, TEST_PATH) &&
+            Workers::Default()->Init(4);
+  RockinServer::Default()->Init(2);
+  ok = ok && RockinServer::Default()->Service(TEST_PORT);
+  assert(ok);
+
+  int fd = Connect();
+  Replies replies(fd);
+  for (int round = 0; round < TEST_ROUNDS; round++) {
+    TestSetFlushGet(fd, replies, round);
+  }
+
+  // the keys are written again after the last flush
+  WriteAll(fd, Command("set", "key:0", "again") + Command("get", "key:0"));
+  assert(replies.Next() == "+OK");
+  assert(replies.Next() == "$5|again");
+
+  close(fd);
+  printf("flush_test: %d rounds of %d keys ok\n", TEST_ROUNDS, TEST_KEYS);
+  return 0;
+}